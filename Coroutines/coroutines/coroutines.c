@@ -1,18 +1,65 @@
-﻿#include "coroutines.h"
+﻿#if !defined(_WIN32) && !defined(_DEFAULT_SOURCE)
+// MAP_ANONYMOUS and the ucontext functions are not part of standard C
+#define _DEFAULT_SOURCE
+#endif
+
+#include "coroutines.h"
 
 #include <stdio.h>
+
+#if defined(_WIN32)
+#define CO_BACKEND_FIBERS
+#elif defined(__ELF__) && (defined(__x86_64__) || defined(__aarch64__)) && !defined(CO_USE_UCONTEXT)
+// Hand written context switch, see coroutine_switch_context
+#define CO_BACKEND_ASM
+#else
+// swapcontext is portable but slow, it saves and restores the signal mask with a syscall
+#define CO_BACKEND_UCONTEXT
+#endif
+
+#if defined(CO_BACKEND_FIBERS)
 #include <Windows.h>
+#else
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#if defined(CO_BACKEND_UCONTEXT)
+#include <ucontext.h>
+#endif
+
+// Size of the stack of a coroutine, pages are only backed by memory once touched
+#define CO_STACK_SIZE (256 * 1024)
+#endif
 
 
+#if defined(CO_BACKEND_FIBERS)
 LPVOID g_main_fiber = NULL;
+#endif
 
 struct coroutine
 {
 	void (*function)(coroutine_t*, void *arg);
 	int is_finished;
 	void* arg;
-	void* fiber;
 	void* yield_val;
+#if defined(CO_BACKEND_FIBERS)
+	void* fiber;
+#else
+	// The lowest page of the stack is a guard page
+	void* stack;
+	size_t stack_size;
+#if defined(CO_BACKEND_ASM)
+	// Where coroutine_switch_context left the stack pointer of the coroutine,
+	// and of the one that resumed it
+	void* sp;
+	void* caller_sp;
+#else
+	ucontext_t context;
+	ucontext_t caller_context;
+#endif
+#endif
 };
 
 static void coroutine_entry_point(coroutine_t* self) {
@@ -23,24 +70,319 @@ static void coroutine_entry_point(coroutine_t* self) {
 	}
 }
 
+#if defined(CO_BACKEND_FIBERS)
+
+static COROUTINE_RESULT coroutine_context_init(coroutine_t* co)
+{
+	co->fiber = CreateFiber(0 /* default_stack_size */, coroutine_entry_point, co);
+	return co->fiber != NULL ? CO_OK : CO_OS_ERROR;
+}
+
+static void coroutine_context_destroy(coroutine_t* co)
+{
+	DeleteFiber(co->fiber);
+}
+
+static void coroutine_switch_in(coroutine_t* co)
+{
+	SwitchToFiber(co->fiber);
+}
+
+static void coroutine_switch_out(coroutine_t* co)
+{
+	(void)co;
+	SwitchToFiber(g_main_fiber);
+}
+
+static void* coroutine_alloc(size_t size)
+{
+	return HeapAlloc(GetProcessHeap(), 0, size);
+}
+
+static void coroutine_free(void* ptr)
+{
+	HeapFree(GetProcessHeap(), 0, ptr);
+}
+
+#else
+
+static COROUTINE_RESULT coroutine_stack_init(coroutine_t* co)
+{
+	size_t page_size = (size_t)sysconf(_SC_PAGESIZE);
+	co->stack_size = CO_STACK_SIZE + page_size;
+	int flags = MAP_PRIVATE | MAP_ANONYMOUS;
+#if defined(MAP_STACK)
+	flags |= MAP_STACK;
+#endif
+	co->stack = mmap(NULL, co->stack_size, PROT_READ | PROT_WRITE, flags, -1, 0);
+	if (co->stack == MAP_FAILED)
+	{
+		return CO_OS_ERROR;
+	}
+
+	// Overflowing the stack faults instead of corrupting memory
+	if (mprotect(co->stack, page_size, PROT_NONE) != 0)
+	{
+		munmap(co->stack, co->stack_size);
+		return CO_OS_ERROR;
+	}
+	return CO_OK;
+}
+
+static void coroutine_context_destroy(coroutine_t* co)
+{
+	munmap(co->stack, co->stack_size);
+}
+
+static void* coroutine_alloc(size_t size)
+{
+	return malloc(size);
+}
+
+static void coroutine_free(void* ptr)
+{
+	free(ptr);
+}
+
+#endif
+
+#if defined(CO_BACKEND_ASM)
+
+// Saves the callee-saved registers on the current stack, stores the stack
+// pointer in *from_sp, then switches to to_sp and restores the registers
+// saved there. Everything else is saved by the caller, as for any call.
+//
+// A coroutine that never ran has its stack set up by coroutine_context_init
+// so that the switch "returns" into coroutine_start.
+__attribute__((visibility("hidden"))) void coroutine_switch_context(void** from_sp, void* to_sp);
+__attribute__((visibility("hidden"))) void coroutine_start(void);
+
+#if defined(__x86_64__)
+
+// Registers are pushed in the order rbp, rbx, r12-r15, then MXCSR and the
+// x87 control word (callee-saved too) take 8 more bytes
+__asm__(
+	".pushsection .text\n"
+	".globl coroutine_switch_context\n"
+	".hidden coroutine_switch_context\n"
+	".type coroutine_switch_context, @function\n"
+	".p2align 4\n"
+	"coroutine_switch_context:\n"
+	"	pushq %rbp\n"
+	"	pushq %rbx\n"
+	"	pushq %r12\n"
+	"	pushq %r13\n"
+	"	pushq %r14\n"
+	"	pushq %r15\n"
+	"	subq $8, %rsp\n"
+	"	stmxcsr (%rsp)\n"
+	"	fnstcw 4(%rsp)\n"
+	"	movq %rsp, (%rdi)\n"
+	"	movq %rsi, %rsp\n"
+	"	ldmxcsr (%rsp)\n"
+	"	fldcw 4(%rsp)\n"
+	"	addq $8, %rsp\n"
+	"	popq %r15\n"
+	"	popq %r14\n"
+	"	popq %r13\n"
+	"	popq %r12\n"
+	"	popq %rbx\n"
+	"	popq %rbp\n"
+	"	ret\n"
+	".size coroutine_switch_context, .-coroutine_switch_context\n"
+	"\n"
+	// rbx holds the coroutine and r12 coroutine_entry_point, which never returns
+	".globl coroutine_start\n"
+	".hidden coroutine_start\n"
+	".type coroutine_start, @function\n"
+	".p2align 4\n"
+	"coroutine_start:\n"
+	"	movq %rbx, %rdi\n"
+	"	callq *%r12\n"
+	"	ud2\n"
+	".size coroutine_start, .-coroutine_start\n"
+	".popsection\n"
+);
+
+#define CO_FRAME_SLOTS 8
+
+static void coroutine_frame_init(void** frame, coroutine_t* co)
+{
+	// MXCSR and x87 control word at their power-on values:
+	// round to nearest, all exceptions masked
+	uint32_t mxcsr = 0x1F80;
+	uint16_t fpu_control = 0x037F;
+	memcpy((char*)&frame[0], &mxcsr, sizeof(mxcsr));
+	memcpy((char*)&frame[0] + 4, &fpu_control, sizeof(fpu_control));
+	frame[4] = (void*)coroutine_entry_point; // r12
+	frame[5] = co; // rbx
+	frame[6] = NULL; // rbp
+	// Return address, after the ret the stack is 16 bytes aligned, as
+	// it must be before the call made by coroutine_start
+	frame[7] = (void*)coroutine_start;
+}
+
+#elif defined(__aarch64__)
+
+// x19-x30 (x29 being the frame pointer and x30 the link register)
+// and d8-d15, 160 bytes keeping sp 16 bytes aligned
+__asm__(
+	".pushsection .text\n"
+	".globl coroutine_switch_context\n"
+	".hidden coroutine_switch_context\n"
+	".type coroutine_switch_context, %function\n"
+	".p2align 4\n"
+	"coroutine_switch_context:\n"
+	"	sub sp, sp, #160\n"
+	"	stp x19, x20, [sp, #0]\n"
+	"	stp x21, x22, [sp, #16]\n"
+	"	stp x23, x24, [sp, #32]\n"
+	"	stp x25, x26, [sp, #48]\n"
+	"	stp x27, x28, [sp, #64]\n"
+	"	stp x29, x30, [sp, #80]\n"
+	"	stp d8, d9, [sp, #96]\n"
+	"	stp d10, d11, [sp, #112]\n"
+	"	stp d12, d13, [sp, #128]\n"
+	"	stp d14, d15, [sp, #144]\n"
+	"	mov x9, sp\n"
+	"	str x9, [x0]\n"
+	"	mov sp, x1\n"
+	"	ldp x19, x20, [sp, #0]\n"
+	"	ldp x21, x22, [sp, #16]\n"
+	"	ldp x23, x24, [sp, #32]\n"
+	"	ldp x25, x26, [sp, #48]\n"
+	"	ldp x27, x28, [sp, #64]\n"
+	"	ldp x29, x30, [sp, #80]\n"
+	"	ldp d8, d9, [sp, #96]\n"
+	"	ldp d10, d11, [sp, #112]\n"
+	"	ldp d12, d13, [sp, #128]\n"
+	"	ldp d14, d15, [sp, #144]\n"
+	"	add sp, sp, #160\n"
+	"	ret\n"
+	".size coroutine_switch_context, .-coroutine_switch_context\n"
+	"\n"
+	// x19 holds the coroutine and x20 coroutine_entry_point, which never returns
+	".globl coroutine_start\n"
+	".hidden coroutine_start\n"
+	".type coroutine_start, %function\n"
+	".p2align 4\n"
+	"coroutine_start:\n"
+	"	mov x0, x19\n"
+	"	blr x20\n"
+	"	brk #0\n"
+	".size coroutine_start, .-coroutine_start\n"
+	".popsection\n"
+);
+
+#define CO_FRAME_SLOTS 20
+
+static void coroutine_frame_init(void** frame, coroutine_t* co)
+{
+	frame[0] = co; // x19
+	frame[1] = (void*)coroutine_entry_point; // x20
+	frame[10] = NULL; // x29, ends the chain of frames
+	frame[11] = (void*)coroutine_start; // x30
+}
+
+#endif
+
+static COROUTINE_RESULT coroutine_context_init(coroutine_t* co)
+{
+	COROUTINE_RESULT result = coroutine_stack_init(co);
+	if (result != CO_OK)
+	{
+		return result;
+	}
+
+	// The frame coroutine_switch_context restores, at the top of the stack
+	uintptr_t top = ((uintptr_t)co->stack + co->stack_size) & ~(uintptr_t)15;
+	void** frame = (void**)top - CO_FRAME_SLOTS;
+	memset(frame, 0, CO_FRAME_SLOTS * sizeof(void*));
+	coroutine_frame_init(frame, co);
+	co->sp = frame;
+	co->caller_sp = NULL;
+	return CO_OK;
+}
+
+static void coroutine_switch_in(coroutine_t* co)
+{
+	coroutine_switch_context(&co->caller_sp, co->sp);
+}
+
+static void coroutine_switch_out(coroutine_t* co)
+{
+	coroutine_switch_context(&co->sp, co->caller_sp);
+}
+
+#elif defined(CO_BACKEND_UCONTEXT)
+
+// makecontext only passes int arguments, so the pointer is split in two
+static void coroutine_ucontext_entry(unsigned int high, unsigned int low)
+{
+	coroutine_t* co = (coroutine_t*)(uintptr_t)(((uint64_t)high << 32) | low);
+	coroutine_entry_point(co);
+}
+
+static COROUTINE_RESULT coroutine_context_init(coroutine_t* co)
+{
+	COROUTINE_RESULT result = coroutine_stack_init(co);
+	if (result != CO_OK)
+	{
+		return result;
+	}
+
+	if (getcontext(&co->context) != 0)
+	{
+		munmap(co->stack, co->stack_size);
+		return CO_OS_ERROR;
+	}
+	size_t page_size = (size_t)sysconf(_SC_PAGESIZE);
+	co->context.uc_stack.ss_sp = (char*)co->stack + page_size;
+	co->context.uc_stack.ss_size = co->stack_size - page_size;
+	// coroutine_entry_point never returns
+	co->context.uc_link = NULL;
+	uint64_t address = (uintptr_t)co;
+	makecontext(&co->context, (void (*)(void))coroutine_ucontext_entry, 2,
+		(unsigned int)(address >> 32), (unsigned int)address);
+	return CO_OK;
+}
+
+static void coroutine_switch_in(coroutine_t* co)
+{
+	swapcontext(&co->caller_context, &co->context);
+}
+
+static void coroutine_switch_out(coroutine_t* co)
+{
+	swapcontext(&co->context, &co->caller_context);
+}
+
+#endif
+
 COROUTINE_RESULT coroutines_init(void)
 {
+#if defined(CO_BACKEND_FIBERS)
 	g_main_fiber = ConvertThreadToFiber(NULL);
 
 	if (g_main_fiber == NULL)
 	{
 		return CO_OS_ERROR;
 	}
+#endif
 
 	return CO_OK;
 }
 
 COROUTINE_RESULT coroutines_shutdown(void)
 {
+#if defined(CO_BACKEND_FIBERS)
 	if (ConvertFiberToThread() == FALSE)
 	{
 		return CO_OS_ERROR;
 	}
+#endif
+
+	return CO_OK;
 }
 
 COROUTINE_RESULT coroutine_new(coroutine_t** self, coroutine_fn fn, void* arg)
@@ -50,7 +392,7 @@ COROUTINE_RESULT coroutine_new(coroutine_t** self, coroutine_fn fn, void* arg)
 		return CO_UNSPECIFIED_ERROR;
 	}
 	
-	coroutine_t* co = HeapAlloc(GetProcessHeap(), 0, sizeof(coroutine_t));
+	coroutine_t* co = coroutine_alloc(sizeof(coroutine_t));
 
 	if (co == NULL)
 	{
@@ -59,14 +401,14 @@ COROUTINE_RESULT coroutine_new(coroutine_t** self, coroutine_fn fn, void* arg)
 
 	co->function = fn;
 	co->arg = arg;
-	co->is_finished = FALSE;
+	co->is_finished = 0;
 	co->yield_val = NULL;
-	co->fiber = CreateFiber(0 /* default_stack_size */, coroutine_entry_point, co);
 
-	if (co->fiber == NULL)
+	COROUTINE_RESULT result = coroutine_context_init(co);
+	if (result != CO_OK)
 	{
-		HeapFree(GetProcessHeap(), 0, co);
-		return CO_OS_ERROR;
+		coroutine_free(co);
+		return result;
 	}
 
 	*self = co;
@@ -78,27 +420,27 @@ COROUTINE_RESULT coroutine_new(coroutine_t** self, coroutine_fn fn, void* arg)
 void coroutine_yield_value(coroutine_t* self, void* value)
 {
 	self->yield_val = value;
-	SwitchToFiber(g_main_fiber);
+	coroutine_switch_out(self);
 }
 
 void coroutine_yield(coroutine_t* self)
 {
 	self->yield_val = NULL;
-	SwitchToFiber(g_main_fiber);
+	coroutine_switch_out(self);
 }
 
 void coroutine_return(coroutine_t* self)
 {
-	self->is_finished = TRUE;
-	SwitchToFiber(g_main_fiber);
+	self->is_finished = 1;
+	coroutine_switch_out(self);
 }
 
 
 void coroutine_resume(coroutine_t* self)
 {
-	if (self->is_finished == FALSE)
+	if (!self->is_finished)
 	{
-		SwitchToFiber(self->fiber);
+		coroutine_switch_in(self);
 	}
 }
 
@@ -125,6 +467,6 @@ void coroutine_delete(coroutine_t *self)
 		return;
 	}
 
-	DeleteFiber(self->fiber);
-	HeapFree(GetProcessHeap(), 0, self);
+	coroutine_context_destroy(self);
+	coroutine_free(self);
 }
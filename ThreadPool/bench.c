@@ -0,0 +1,378 @@
+#if defined(__unix__) && !defined(_POSIX_C_SOURCE)
+// For clock_gettime()
+#define _POSIX_C_SOURCE 199309L
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <time.h>
+#include <math.h>
+
+#include "thread_pool.h"
+
+#if !defined(__STDC_NO_THREADS__)
+#include <threads.h>
+#endif
+
+#if defined(WIN32)
+#include <windows.h>
+#endif
+
+// Benchmarks of the thread pool, results are printed as CSV on stdout:
+//
+//   benchmark,threads,producers,size,value,unit
+//
+// usage: c_thrd_pool_bench [max_threads]
+
+/// Monotonic time, the wall clock may jump in the middle of a measure
+static uint64_t now_ns(void) {
+#if defined(WIN32)
+    LARGE_INTEGER counter, frequency;
+    QueryPerformanceCounter(&counter);
+    QueryPerformanceFrequency(&frequency);
+    return (uint64_t)((double)counter.QuadPart * 1e9 / (double)frequency.QuadPart);
+#elif defined(__unix__) || defined(__APPLE__)
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000u + (uint64_t)now.tv_nsec;
+#else
+    struct timespec now;
+    timespec_get(&now, TIME_UTC);
+    return (uint64_t)now.tv_sec * 1000000000u + (uint64_t)now.tv_nsec;
+#endif
+}
+
+static void print_row(const char *benchmark, size_t threads, size_t producers, size_t size,
+                      double value, const char *unit) {
+    printf("%s,%zu,%zu,%zu,%.3f,%s\n", benchmark, threads, producers, size, value, unit);
+    fflush(stdout);
+}
+
+static void empty_task(void *arg) {
+    (void)arg;
+}
+
+/// Number of tasks each producer submits in the throughput benchmark
+#define SUBMIT_COUNT 1000000
+
+typedef struct producer_s {
+    thread_pool_t *pool;
+    size_t count;
+} producer_t;
+
+static int producer_main(void *arg) {
+    producer_t *producer = arg;
+    for (size_t i = 0; i < producer->count; ++i) {
+        thread_pool_add_task(producer->pool, empty_task, NULL);
+    }
+    return 0;
+}
+
+/// Empty tasks submitted one by one from threads outside of the pool,
+/// the time measured goes up to the end of thread_pool_wait
+static void bench_submit(thread_pool_t *pool, size_t threads, size_t num_producers) {
+    producer_t producer = {
+        .pool = pool,
+        .count = SUBMIT_COUNT / num_producers,
+    };
+
+    uint64_t start = now_ns();
+    if (num_producers == 1) {
+        producer_main(&producer);
+    } else {
+#if !defined(__STDC_NO_THREADS__)
+        thrd_t *producers = malloc(sizeof(*producers) * num_producers);
+        if (producers == NULL) {
+            return;
+        }
+        for (size_t i = 0; i < num_producers; ++i) {
+            if (thrd_create(&producers[i], producer_main, &producer) != thrd_success) {
+                fprintf(stderr, "Failure when creating producer threads\n");
+                exit(EXIT_FAILURE);
+            }
+        }
+        for (size_t i = 0; i < num_producers; ++i) {
+            thrd_join(producers[i], NULL);
+        }
+        free(producers);
+#else
+        return;
+#endif
+    }
+    thread_pool_wait(pool);
+    uint64_t elapsed = now_ns() - start;
+
+    size_t total = producer.count * num_producers;
+    print_row("submit_and_wait_throughput", threads, num_producers, total, (double)total * 1e9 / (double)elapsed, "tasks/s");
+}
+
+/// Empty tasks submitted in one batch,
+/// the time measured goes up to the end of thread_pool_wait
+static void bench_submit_batch(thread_pool_t *pool, size_t threads) {
+    uint64_t start = now_ns();
+    thread_pool_add_tasks(pool, empty_task, NULL, SUBMIT_COUNT, 0);
+    thread_pool_wait(pool);
+    uint64_t elapsed = now_ns() - start;
+
+    print_row("submit_batch_and_wait_throughput", threads, 1, SUBMIT_COUNT, (double)SUBMIT_COUNT * 1e9 / (double)elapsed, "tasks/s");
+}
+
+/// Number of samples of the latency benchmark
+#define LATENCY_SAMPLES 10000
+
+static void record_start(void *arg) {
+    *(uint64_t *)arg = now_ns();
+}
+
+static int compare_u64(const void *lhs, const void *rhs) {
+    uint64_t a = *(const uint64_t *)lhs;
+    uint64_t b = *(const uint64_t *)rhs;
+    return (a > b) - (a < b);
+}
+
+static void print_percentiles(const char *benchmark, size_t threads, uint64_t *samples, size_t count) {
+    static const double percentiles[] = {50.0, 90.0, 99.0, 99.9};
+    static const char *names[] = {"p50", "p90", "p99", "p999"};
+
+    qsort(samples, count, sizeof(*samples), compare_u64);
+    for (size_t i = 0; i < sizeof(percentiles) / sizeof(percentiles[0]); ++i) {
+        size_t index = (size_t)(percentiles[i] / 100.0 * (double)(count - 1));
+        char name[64];
+        snprintf(name, sizeof(name), "%s_%s", benchmark, names[i]);
+        print_row(name, threads, 1, count, (double)samples[index], "ns");
+    }
+}
+
+/// Time from submitting a task to an idle pool until the task starts,
+/// and until thread_pool_wait returns
+static void bench_latency(thread_pool_t *pool, size_t threads) {
+    uint64_t *start_latencies = malloc(sizeof(uint64_t) * LATENCY_SAMPLES);
+    uint64_t *end_latencies = malloc(sizeof(uint64_t) * LATENCY_SAMPLES);
+    if (start_latencies == NULL || end_latencies == NULL) {
+        free(start_latencies);
+        free(end_latencies);
+        return;
+    }
+
+    for (size_t i = 0; i < LATENCY_SAMPLES; ++i) {
+        uint64_t started = 0;
+        uint64_t submitted = now_ns();
+        thread_pool_add_task(pool, record_start, &started);
+        thread_pool_wait(pool);
+        uint64_t done = now_ns();
+        start_latencies[i] = started - submitted;
+        end_latencies[i] = done - submitted;
+    }
+
+    print_percentiles("latency_start", threads, start_latencies, LATENCY_SAMPLES);
+    print_percentiles("latency_end_to_end", threads, end_latencies, LATENCY_SAMPLES);
+    free(start_latencies);
+    free(end_latencies);
+}
+
+typedef struct fan_out_s {
+    thread_pool_group_t *group;
+    size_t width;
+} fan_out_t;
+
+static void fan_out_root(void *arg) {
+    fan_out_t *fan_out = arg;
+    thread_pool_group_add_tasks(fan_out->group, empty_task, NULL, fan_out->width, 0);
+    thread_pool_group_wait(fan_out->group);
+}
+
+/// A task spawning width empty tasks and waiting for them
+static void bench_fan_out(thread_pool_t *pool, size_t threads, size_t width) {
+    fan_out_t fan_out = {
+        .group = thread_pool_group_create(pool),
+        .width = width,
+    };
+    if (fan_out.group == NULL) {
+        return;
+    }
+
+    size_t iterations = 1 + 1000000 / width;
+    uint64_t start = now_ns();
+    for (size_t i = 0; i < iterations; ++i) {
+        thread_pool_add_task(pool, fan_out_root, &fan_out);
+        thread_pool_wait(pool);
+    }
+    uint64_t elapsed = now_ns() - start;
+
+    print_row("fan_out_fan_in", threads, 1, width, (double)elapsed / (double)iterations, "ns/iteration");
+    thread_pool_group_delete(fan_out.group);
+}
+
+/// Number of elements of the parallel for benchmark
+#define PARALLEL_FOR_SIZE (1 << 24)
+
+static double parallel_for_kernel(size_t i) {
+    double x = (double)i;
+    return sqrt(x) * sin(x) + cos(x);
+}
+
+static void parallel_for_body(void *ctx, size_t begin, size_t end) {
+    double *out = ctx;
+    for (size_t i = begin; i < end; ++i) {
+        out[i] = parallel_for_kernel(i);
+    }
+}
+
+static double bench_serial(double *out) {
+    uint64_t start = now_ns();
+    parallel_for_body(out, 0, PARALLEL_FOR_SIZE);
+    return (double)(now_ns() - start) / 1e9;
+}
+
+static void bench_parallel_for(thread_pool_t *pool, size_t threads, double *out, double serial_time) {
+    uint64_t start = now_ns();
+    thread_pool_parallel_for(pool, 0, PARALLEL_FOR_SIZE, 1024, parallel_for_body, out);
+    double elapsed = (double)(now_ns() - start) / 1e9;
+
+    print_row("parallel_for", threads, 1, PARALLEL_FOR_SIZE, elapsed, "s");
+    print_row("parallel_for_speedup", threads, 1, PARALLEL_FOR_SIZE, serial_time / elapsed, "x");
+}
+
+static void sum_reduce(void *ctx, size_t begin, size_t end, void *partial) {
+    const double *values = ctx;
+    double sum = 0.0;
+    for (size_t i = begin; i < end; ++i) {
+        sum += values[i];
+    }
+    *(double *)partial += sum;
+}
+
+static void sum_combine(void *ctx, void *dest, const void *src) {
+    (void)ctx;
+    *(double *)dest += *(const double *)src;
+}
+
+/// Scans values into scan_out
+static double *scan_out;
+
+static void sum_scan(void *ctx, size_t begin, size_t end, const void *prefix) {
+    const double *values = ctx;
+    double sum = *(const double *)prefix;
+    for (size_t i = begin; i < end; ++i) {
+        sum += values[i];
+        scan_out[i] = sum;
+    }
+}
+
+/// Sum and prefix sum of size doubles, against the same loops run serially
+static void bench_reduce_scan(thread_pool_t *pool, size_t threads, double *values, size_t size) {
+    const double zero = 0.0;
+    double result = 0.0;
+    size_t repeats = 1 + PARALLEL_FOR_SIZE / 4 / size;
+
+    uint64_t start = now_ns();
+    for (size_t r = 0; r < repeats; ++r) {
+        result = 0.0;
+        sum_reduce(values, 0, size, &result);
+    }
+    double serial = (double)(now_ns() - start) / (double)repeats;
+
+    start = now_ns();
+    for (size_t r = 0; r < repeats; ++r) {
+        thread_pool_parallel_reduce(pool, 0, size, 4096, &zero, &result, sizeof(result),
+                                    sum_reduce, sum_combine, values);
+    }
+    double parallel = (double)(now_ns() - start) / (double)repeats;
+    print_row("parallel_reduce", threads, 1, size, parallel, "ns");
+    print_row("parallel_reduce_speedup", threads, 1, size, serial / parallel, "x");
+
+    start = now_ns();
+    for (size_t r = 0; r < repeats; ++r) {
+        sum_scan(values, 0, size, &zero);
+    }
+    serial = (double)(now_ns() - start) / (double)repeats;
+
+    start = now_ns();
+    for (size_t r = 0; r < repeats; ++r) {
+        thread_pool_parallel_scan(pool, 0, size, 4096, &zero, sizeof(zero),
+                                  sum_reduce, sum_combine, sum_scan, values);
+    }
+    parallel = (double)(now_ns() - start) / (double)repeats;
+    print_row("parallel_scan", threads, 1, size, parallel, "ns");
+    print_row("parallel_scan_speedup", threads, 1, size, serial / parallel, "x");
+}
+
+#if defined(_OPENMP)
+static void bench_openmp(size_t threads, double *out, double serial_time) {
+    uint64_t start = now_ns();
+    #pragma omp parallel for num_threads((int)threads) schedule(static)
+    for (long i = 0; i < PARALLEL_FOR_SIZE; ++i) {
+        out[i] = parallel_for_kernel((size_t)i);
+    }
+    double elapsed = (double)(now_ns() - start) / 1e9;
+
+    print_row("openmp_for", threads, 1, PARALLEL_FOR_SIZE, elapsed, "s");
+    print_row("openmp_for_speedup", threads, 1, PARALLEL_FOR_SIZE, serial_time / elapsed, "x");
+}
+#endif
+
+int main(int argc, char **argv) {
+    thread_pool_t *probe = thread_pool_create(0);
+    if (probe == NULL) {
+        fprintf(stderr, "Failure when creating the thread_pool\n");
+        return EXIT_FAILURE;
+    }
+    size_t max_threads = thread_pool_num_threads(probe);
+    thread_pool_delete(probe);
+    if (argc > 1) {
+        max_threads = (size_t)strtoul(argv[1], NULL, 10);
+    }
+    if (max_threads == 0) {
+        fprintf(stderr, "usage: %s [max_threads]\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    double *out = malloc(sizeof(double) * PARALLEL_FOR_SIZE);
+    scan_out = malloc(sizeof(double) * PARALLEL_FOR_SIZE);
+    if (out == NULL || scan_out == NULL) {
+        fprintf(stderr, "Failure when creating values\n");
+        return EXIT_FAILURE;
+    }
+    // The first run pays for the page faults of out
+    bench_serial(out);
+    double serial_time = bench_serial(out);
+
+    printf("benchmark,threads,producers,size,value,unit\n");
+    print_row("serial_for", 1, 1, PARALLEL_FOR_SIZE, serial_time, "s");
+
+    // 1, 2, 4, ... and max_threads
+    for (size_t threads = 1;; threads = threads * 2 < max_threads ? threads * 2 : max_threads) {
+        thread_pool_t *pool = thread_pool_create(threads);
+        if (pool == NULL) {
+            fprintf(stderr, "Failure when creating the thread_pool\n");
+            return EXIT_FAILURE;
+        }
+
+        bench_submit(pool, threads, 1);
+        if (threads > 1) {
+            bench_submit(pool, threads, threads);
+        }
+        bench_submit_batch(pool, threads);
+        bench_latency(pool, threads);
+        bench_fan_out(pool, threads, 16);
+        bench_fan_out(pool, threads, 256);
+        bench_fan_out(pool, threads, 4096);
+        bench_parallel_for(pool, threads, out, serial_time);
+#if defined(_OPENMP)
+        bench_openmp(threads, out, serial_time);
+#endif
+        for (size_t size = 100000; size <= PARALLEL_FOR_SIZE; size *= 10) {
+            bench_reduce_scan(pool, threads, out, size);
+        }
+
+        thread_pool_delete(pool);
+        if (threads == max_threads) {
+            break;
+        }
+    }
+
+    free(out);
+    free(scan_out);
+    return 0;
+}
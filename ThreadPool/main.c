@@ -54,9 +54,7 @@ int main(void) {
         vals[i] = (int)i;
     }
 
-    for (size_t i=0; i<num_items; i++) {
-        thread_pool_add_task(pool, worker, vals+i);
-    }
+    thread_pool_add_tasks(pool, worker, vals, num_items, sizeof(*vals));
 
     thread_pool_wait(pool);
 
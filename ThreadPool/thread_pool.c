@@ -1,18 +1,43 @@
+#if defined(__linux__) && !defined(_GNU_SOURCE)
+// For syscall()
+#define _GNU_SOURCE
+#endif
+
 #include <stddef.h>
 #include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
 #include <assert.h>
 #include <malloc.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <time.h>
 
 #include "thread_pool.h"
+#include "thread_pool_internal.h"
 
 #if defined(WIN32)
 #include <windows.h>
 #endif
 
+#if defined(_MSC_VER)
+#include <immintrin.h>
+#endif
+
 #if defined (__unix__) // || (defined (__APPLE__) && defined (__MACH__))
 #include <unistd.h>
 #endif
 
+#if defined(__linux__)
+#include <errno.h>
+#include <limits.h>
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include <sched.h>
+#include <dirent.h>
+#endif
+
 
 long try_get_num_threads() {
 #if defined (__unix__) // || (defined (__APPLE__) && defined (__MACH__))
@@ -27,6 +52,158 @@ long try_get_num_threads() {
 #endif
 }
 
+void *aligned_malloc(size_t alignment, size_t size) {
+#if defined(WIN32)
+    return _aligned_malloc(size, alignment);
+#else
+    // aligned_alloc wants the size to be a multiple of the alignment
+    size = (size + alignment - 1) & ~(alignment - 1);
+    return aligned_alloc(alignment, size);
+#endif
+}
+
+void aligned_free(void *ptr) {
+#if defined(WIN32)
+    _aligned_free(ptr);
+#else
+    free(ptr);
+#endif
+}
+
+/// Returns a monotonic time in nanoseconds
+uint64_t get_time_ns(void) {
+#if defined(WIN32)
+    LARGE_INTEGER counter, frequency;
+    QueryPerformanceCounter(&counter);
+    QueryPerformanceFrequency(&frequency);
+    return (uint64_t)((double)counter.QuadPart * 1e9 / (double)frequency.QuadPart);
+#elif defined(__unix__) || defined(__APPLE__)
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000u + (uint64_t)now.tv_nsec;
+#else
+    struct timespec now;
+    timespec_get(&now, TIME_UTC);
+    return (uint64_t)now.tv_sec * 1000000000u + (uint64_t)now.tv_nsec;
+#endif
+}
+
+/// Hints the CPU that we are busy waiting
+void cpu_relax(void) {
+#if defined(_MSC_VER) && (defined(_M_X64) || defined(_M_IX86))
+    _mm_pause();
+#elif defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#elif defined(__aarch64__) || defined(__arm__)
+    __asm__ __volatile__("yield");
+#endif
+}
+
+/// Highest number of CPUs the pool knows how to place workers on
+#define MAX_CPUS 1024
+
+/// Fills cpus with the ids of the CPUs the process is allowed to run on
+///
+/// \return How many there are, 0 if this cannot be determined
+size_t try_get_allowed_cpus(int *cpus, size_t max_cpus) {
+    size_t count = 0;
+#if defined(__linux__)
+    cpu_set_t set;
+    if (sched_getaffinity(0, sizeof(set), &set) != 0) {
+        return 0;
+    }
+    for (int cpu = 0; cpu < CPU_SETSIZE && count < max_cpus; ++cpu) {
+        if (CPU_ISSET(cpu, &set)) {
+            cpus[count++] = cpu;
+        }
+    }
+#elif defined(WIN32)
+    DWORD_PTR process_mask, system_mask;
+    if (!GetProcessAffinityMask(GetCurrentProcess(), &process_mask, &system_mask)) {
+        return 0;
+    }
+    for (int cpu = 0; cpu < (int)(sizeof(process_mask) * 8) && count < max_cpus; ++cpu) {
+        if (process_mask & ((DWORD_PTR)1 << cpu)) {
+            cpus[count++] = cpu;
+        }
+    }
+#else
+    (void)cpus;
+    (void)max_cpus;
+#endif
+    return count;
+}
+
+/// Returns the NUMA node of the CPU, -1 if unknown
+int try_get_cpu_node(int cpu) {
+#if defined(__linux__)
+    // /sys/devices/system/cpu/cpuN contains a nodeM link to its node
+    char path[64];
+    snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d", cpu);
+    DIR *dir = opendir(path);
+    if (dir == NULL) {
+        return -1;
+    }
+    int node = -1;
+    struct dirent *entry;
+    while (node == -1 && (entry = readdir(dir)) != NULL) {
+        if (strncmp(entry->d_name, "node", 4) == 0 && entry->d_name[4] >= '0' && entry->d_name[4] <= '9') {
+            node = atoi(entry->d_name + 4);
+        }
+    }
+    closedir(dir);
+    return node;
+#elif defined(WIN32)
+    UCHAR node;
+    if (cpu > 255 || !GetNumaProcessorNode((UCHAR)cpu, &node) || node == 0xFF) {
+        return -1;
+    }
+    return node;
+#else
+    (void)cpu;
+    return -1;
+#endif
+}
+
+/// Returns the CPU the calling thread is running on, -1 if unknown
+int try_get_current_cpu(void) {
+#if defined(__linux__)
+    return sched_getcpu();
+#elif defined(WIN32)
+    return (int)GetCurrentProcessorNumber();
+#else
+    return -1;
+#endif
+}
+
+/// Restricts the calling thread to the given CPUs
+///
+/// \return 0 on success
+int thread_set_affinity(const int *cpus, size_t num_cpus) {
+#if defined(__linux__)
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    for (size_t i = 0; i < num_cpus; ++i) {
+        if (cpus[i] < CPU_SETSIZE) {
+            CPU_SET(cpus[i], &set);
+        }
+    }
+    return sched_setaffinity(0, sizeof(set), &set) != 0;
+#elif defined(WIN32)
+    DWORD_PTR mask = 0;
+    for (size_t i = 0; i < num_cpus; ++i) {
+        if (cpus[i] < (int)(sizeof(mask) * 8)) {
+            mask |= (DWORD_PTR)1 << cpus[i];
+        }
+    }
+    return mask == 0 || SetThreadAffinityMask(GetCurrentThread(), mask) == 0;
+#else
+    (void)cpus;
+    (void)num_cpus;
+    return 1;
+#endif
+}
+
 #if !defined(__STDC_NO_THREADS__)
 #include <threads.h>
 
@@ -36,17 +213,16 @@ typedef int main_thread_fn_return_t;
 typedef main_thread_fn_return_t(thread_fn_main_t)(void*);
 
 int thread_create(thread_t *thread, thread_fn_main_t thread_fn_main, void*arg) {
-    int status = thrd_create(thread, thread_fn_main, arg);
-    if (status != 0) {
-        return 1;
-    }
-    status = thrd_detach(*thread);
-    return status != 0;
+    return thrd_create(thread, thread_fn_main, arg) != thrd_success;
+}
+
+/// Waits for the thread to exit and releases it
+int thread_join(thread_t *thread) {
+    return thrd_join(*thread, NULL) != thrd_success;
 }
 
-void thread_destroy(thread_t* thread) {
-    (void*)thread;
-    // There is nothing to do for std threads
+void thread_yield(void) {
+    thrd_yield();
 }
 
 typedef mtx_t mutex_t;
@@ -106,11 +282,18 @@ int thread_create(thread_t *thread, thread_fn_main_t thread_fn_main, void*arg) {
         0, // Threads will run immediately
         NULL // We don't want to have the thread id
     );
-     return thread == NULL;
+     return *thread == NULL;
 }
 
-void thread_destroy(thread_t* thread) {
+/// Waits for the thread to exit and releases it
+int thread_join(thread_t *thread) {
+    DWORD status = WaitForSingleObject(*thread, INFINITE);
     CloseHandle(*thread);
+    return status != WAIT_OBJECT_0;
+}
+
+void thread_yield(void) {
+    SwitchToThread();
 }
 
 typedef CRITICAL_SECTION mutex_t;
@@ -163,6 +346,80 @@ void condvar_destroy(condvar_t *condvar) {
 #error "This compiler & standard library does not have C11's threads"
 #endif
 
+// Futexes let a thread sleep until the value at some address changes,
+// without needing a mutex
+
+#if defined(__linux__)
+/// Sleeps while *address == expected, may return spuriously
+void futex_wait(_Atomic uint32_t *address, uint32_t expected) {
+    syscall(SYS_futex, address, FUTEX_WAIT_PRIVATE, expected, NULL, NULL, 0);
+}
+
+/// Same as futex_wait, giving up after timeout_ns
+///
+/// \return false if the timeout expired
+bool futex_wait_timeout(_Atomic uint32_t *address, uint32_t expected, uint64_t timeout_ns) {
+    struct timespec timeout = {
+        .tv_sec = (time_t)(timeout_ns / 1000000000u),
+        .tv_nsec = (long)(timeout_ns % 1000000000u),
+    };
+    long result = syscall(SYS_futex, address, FUTEX_WAIT_PRIVATE, expected, &timeout, NULL, 0);
+    return result == 0 || errno != ETIMEDOUT;
+}
+
+void futex_wake_one(_Atomic uint32_t *address) {
+    syscall(SYS_futex, address, FUTEX_WAKE_PRIVATE, 1, NULL, NULL, 0);
+}
+
+void futex_wake_all(_Atomic uint32_t *address) {
+    syscall(SYS_futex, address, FUTEX_WAKE_PRIVATE, INT_MAX, NULL, NULL, 0);
+}
+#elif defined(WIN32)
+// Needs Synchronization.lib
+void futex_wait(_Atomic uint32_t *address, uint32_t expected) {
+    WaitOnAddress((volatile VOID *)address, &expected, sizeof(expected), INFINITE);
+}
+
+bool futex_wait_timeout(_Atomic uint32_t *address, uint32_t expected, uint64_t timeout_ns) {
+    DWORD timeout_ms = (DWORD)(timeout_ns / 1000000u);
+    return WaitOnAddress((volatile VOID *)address, &expected, sizeof(expected), timeout_ms)
+           || GetLastError() != ERROR_TIMEOUT;
+}
+
+void futex_wake_one(_Atomic uint32_t *address) {
+    WakeByAddressSingle((PVOID)address);
+}
+
+void futex_wake_all(_Atomic uint32_t *address) {
+    WakeByAddressAll((PVOID)address);
+}
+#else
+// No futex, waiters just yield until the value changes
+void futex_wait(_Atomic uint32_t *address, uint32_t expected) {
+    (void)address;
+    (void)expected;
+    thread_yield();
+}
+
+// Never times out, the caller keeps waiting
+bool futex_wait_timeout(_Atomic uint32_t *address, uint32_t expected, uint64_t timeout_ns) {
+    (void)timeout_ns;
+    futex_wait(address, expected);
+    return true;
+}
+
+void futex_wake_one(_Atomic uint32_t *address) {
+    (void)address;
+}
+
+void futex_wake_all(_Atomic uint32_t *address) {
+    (void)address;
+}
+#endif
+
+
+/// Size of the argument storage embedded in a task
+#define TASK_INLINE_ARG_SIZE THREAD_POOL_INLINE_DATA_SIZE
 
 /// Definition of a task
 typedef struct thread_task_s {
@@ -170,261 +427,3950 @@ typedef struct thread_task_s {
     thread_task_fn_t *fn;
     /// The argument of the function
     void *arg;
-    /// Pointer to next task (if any)
-    struct thread_task_s *next;
+    /// The group the task belongs to, if any
+    thread_pool_group_t *group;
+    /// When true, fn is given a pointer to inline_arg instead of arg
+    bool has_inline_arg;
+    /// When the task was queued, only set when the pool collects stats or records traces
+    uint64_t enqueue_time;
+    /// Handle through which the task can be cancelled, if any
+    thread_pool_task_handle_t *handle;
+    /// Time after which the task is dropped instead of run, 0 for none
+    uint64_t deadline;
+    /// Name of the task in traces, NULL for none
+    const char *label;
+    /// Scope of the task that added it, if any, see task_scope_s
+    struct task_scope_s *scope;
+    /// Argument copied into the task itself
+    union {
+        max_align_t align;
+        unsigned char bytes[TASK_INLINE_ARG_SIZE];
+    } inline_arg;
 } thread_task_t;
 
+/// A task calling fn with arg, with none of the other fields set
+static thread_task_t task_init(thread_task_fn_t *fn, void *arg) {
+    thread_task_t task = {
+        .fn = fn,
+        .arg = arg,
+        .group = NULL,
+        .has_inline_arg = false,
+        .enqueue_time = 0,
+        .handle = NULL,
+        .deadline = 0,
+        .label = NULL,
+        .scope = NULL,
+    };
+    return task;
+}
+
+struct task_cache_s;
+
+/// A task stored in memory owned by a thread,
+/// this is what the deques and the injection list hold
+typedef struct task_node_s {
+    _Alignas(CACHE_LINE_SIZE) thread_task_t task;
+    /// Pointer to next node (if any)
+    struct task_node_s *next;
+    /// The cache the node goes back to once its task is taken
+    struct task_cache_s *owner;
+} task_node_t;
+
+/// Number of nodes in a slab
+#define TASK_SLAB_SIZE 64
+/// Nodes freed by a thread that does not own them are given back
+/// to their owner by batches of (at most) that many
+#define TASK_FREE_BATCH_SIZE 32
+
+typedef struct task_slab_s {
+    task_node_t nodes[TASK_SLAB_SIZE];
+    struct task_slab_s *next;
+} task_slab_t;
+
+/// Where a thread gets task nodes from, nodes are allocated by slabs
+/// and never given back to the heap before the pool is deleted
+typedef struct task_cache_s {
+    /// Nodes only the owner uses
+    task_node_t *free_nodes;
+    /// Slabs allocated by the cache
+    task_slab_t *slabs;
+    /// Nodes given back by other threads, the owner takes them all at once
+    _Alignas(CACHE_LINE_SIZE) _Atomic(task_node_t *) remote_free_nodes;
+} task_cache_t;
+
+/// Nodes a thread is about to give back to the cache that owns them
+typedef struct task_free_batch_s {
+    task_cache_t *owner;
+    task_node_t *first;
+    task_node_t *last;
+    size_t count;
+} task_free_batch_t;
+
+/// FIFO of task nodes
+typedef struct task_list_s {
+    task_node_t *first;
+    task_node_t *last;
+} task_list_t;
+
+/// Growable circular buffer backing a task deque
+typedef struct task_array_s {
+    /// Capacity, always a power of two
+    int64_t capacity;
+    /// Previous (smaller) buffer, kept alive until the pool is deleted
+    /// as thieves may still be reading from it
+    struct task_array_s *retired;
+    _Atomic(task_node_t *) tasks[];
+} task_array_t;
+
+/// Chase-Lev work-stealing deque
+///
+/// The owner pushes and takes at the bottom,
+/// other threads steal from the top.
+///
+/// "Correct and Efficient Work-Stealing for Weak Memory Models", Lê et al. 2013
+typedef struct task_deque_s {
+    _Alignas(CACHE_LINE_SIZE) _Atomic int64_t top;
+    _Alignas(CACHE_LINE_SIZE) _Atomic int64_t bottom;
+    _Atomic(task_array_t *) array;
+} task_deque_t;
+
+#define TASK_DEQUE_INITIAL_CAPACITY 256
+
+/// Value returned by task_deque_steal when it lost a race with
+/// another thread, meaning the deque may still contain tasks
+#define TASK_DEQUE_ABORT ((task_node_t *)1)
+
+/// A slot of an mpmc_ring_t, followed by the item
+typedef struct mpmc_ring_cell_s {
+    /// Tells whether the cell is ready to be written to or read from
+    /// for a given position in the ring
+    _Atomic size_t sequence;
+    max_align_t item[];
+} mpmc_ring_cell_t;
+
+/// Counters of a worker, see thread_pool_worker_stats_t
+///
+/// Only the owner writes to them (except for the slot shared by threads
+/// that are not part of the pool), others may read them at any time
+typedef struct worker_stats_s {
+    _Alignas(CACHE_LINE_SIZE) _Atomic uint64_t tasks_executed;
+    _Atomic uint64_t tasks_stolen;
+    _Atomic uint64_t busy_ns;
+    _Atomic uint64_t idle_ns;
+    _Atomic uint64_t lock_wait_ns;
+    _Atomic uint64_t max_queue_depth;
+    _Atomic uint64_t queue_wait_histogram[THREAD_POOL_STATS_BUCKETS];
+    _Atomic uint64_t run_time_histogram[THREAD_POOL_STATS_BUCKETS];
+    /// False for the slot shared by threads that are not part of the pool
+    bool exclusive;
+} worker_stats_t;
+
+/// A task run by a worker, written as a seqlock so that
+/// it can be read while the worker overwrites it
+typedef struct trace_event_s {
+    /// 2n + 1 while the n-th event of the ring is written to the slot,
+    /// 2n + 2 once it is written
+    _Atomic uint64_t sequence;
+    _Atomic uint64_t enqueue_time;
+    _Atomic uint64_t start;
+    _Atomic uint64_t end;
+    _Atomic(const char *) label;
+} trace_event_t;
+
+/// The last events of a worker, or of the threads that are not part of the pool
+typedef struct trace_ring_s {
+    trace_event_t *events;
+    /// Capacity - 1, the capacity being a power of two
+    size_t mask;
+    /// Number of events recorded so far
+    _Alignas(CACHE_LINE_SIZE) _Atomic uint64_t head;
+    /// False for the ring shared by threads that are not part of the pool
+    bool exclusive;
+} trace_ring_t;
+
+/// Bounds of thread_worker_s::spin_limit
+#define WORKER_SPIN_MIN 16
+#define WORKER_SPIN_MAX 1024
+/// Number of cpu_relax per round of spinning
+#define WORKER_SPIN_RELAX 8
+
+/// CPUs the pool runs on, grouped by NUMA node
+typedef struct cpu_topology_s {
+    /// CPU ids, CPUs of a same node are contiguous
+    int *cpus;
+    /// NUMA node of each CPU, -1 when unknown
+    int *nodes;
+    size_t num_cpus;
+} cpu_topology_t;
+
+/// Workers of a NUMA node
+typedef struct pool_node_s {
+    /// Tasks submitted to the node, protected by the pool mutex
+    _Alignas(CACHE_LINE_SIZE) task_list_t tasks;
+    /// Number of tasks in the list, allows to check it without locking
+    _Atomic size_t num_tasks;
+    /// NUMA node number given by the OS, -1 when unknown
+    int os_node;
+    /// Workers of the node are workers[first_worker, first_worker + num_workers)
+    size_t first_worker;
+    size_t num_workers;
+} pool_node_t;
+
+/// A block of memory of a scratch arena
+typedef struct scratch_chunk_s {
+    struct scratch_chunk_s *next;
+    size_t size;
+    _Alignas(max_align_t) unsigned char data[];
+} scratch_chunk_t;
+
+/// Bump allocator of a thread running tasks, rewound after each task
+///
+/// Chunks are kept once allocated, so a worker stops allocating
+/// once it has seen the peak usage of its tasks
+typedef struct scratch_arena_s {
+    scratch_chunk_t *first;
+    /// Chunk allocations are taken from, NULL until the first allocation
+    scratch_chunk_t *current;
+    /// Bytes used in the current chunk
+    size_t used;
+    /// Size of the first chunk
+    size_t chunk_size;
+} scratch_arena_t;
+
+typedef struct thread_worker_s {
+    /// The worker's own tasks, also where others steal from
+    task_deque_t deque;
+
+    thread_pool_t *pool;
+    thread_t thread;
+    size_t index;
+    /// Index in thread_pool_s::nodes of the worker's node
+    size_t node;
+    /// CPUs the worker restricts itself to, none means no restriction
+    const int *cpus;
+    size_t num_cpus;
+    /// State of the generator used to pick victims
+    uint64_t rng_state;
+    /// How many rounds the worker spins before sleeping
+    size_t spin_limit;
+
+    /// The worker's counters, NULL when the pool does not collect stats
+    worker_stats_t *stats;
+
+    /// Whether a thread currently runs the worker, protected by the pool mutex
+    bool active;
+    /// Whether thread was started and not joined yet, a retired worker's
+    /// thread is joined when the slot is reused or the pool is deleted
+    bool joinable;
+    /// Number of tasks the worker started, read by the monitor
+    /// thread of elastic pools to find workers stuck in a task
+    _Atomic uint32_t num_started;
+    /// True while the worker runs a task (not counting the tasks it runs while waiting)
+    _Atomic bool busy;
+    /// Nesting of thread_pool_blocking_begin calls, only used by the worker's thread
+    size_t blocking_depth;
+
+    /// Nodes for the tasks the worker pushes to its deque
+    task_cache_t cache;
+    /// Nodes of other threads the worker took tasks from
+    task_free_batch_t free_batch;
+    /// Memory returned by thread_pool_scratch_alloc
+    scratch_arena_t scratch;
+} thread_worker_t;
+
+/// Resolution of the timers, delays are rounded up to a whole number of ticks
+#define TIMER_TICK_NS 1000000u
+/// The timer wheel has TIMER_LEVELS levels of TIMER_SLOTS slots,
+/// a slot of level l spanning TIMER_SLOTS^l ticks
+#define TIMER_LEVEL_BITS 6
+#define TIMER_SLOTS (1u << TIMER_LEVEL_BITS)
+#define TIMER_LEVELS 6
+/// Timers further away than this are clamped to it (a bit more than 2 years)
+#define TIMER_MAX_TICKS ((UINT64_C(1) << (TIMER_LEVEL_BITS * TIMER_LEVELS)) - 1)
+/// Bucket of the timers that are due and being handed to the pool
+#define TIMER_DUE_BUCKET (TIMER_LEVELS * TIMER_SLOTS)
+/// Null index of timer_entry_s
+#define TIMER_NONE UINT32_MAX
+/// Number of due tasks the timer thread hands to the pool at once
+#define TIMER_BATCH_SIZE 64
+
+/// A delayed or periodic task, linked in a bucket of the wheel
+typedef struct timer_entry_s {
+    thread_task_fn_t *fn;
+    void *arg;
+    /// Tick at which the task is due
+    uint64_t expires;
+    /// Ticks between two runs, 0 for tasks that run once
+    uint64_t period;
+    /// Incremented each time the entry is freed, so that
+    /// handles of a previous use of the entry are rejected
+    uint32_t generation;
+    /// Neighbours in the bucket, or next free entry
+    uint32_t prev;
+    uint32_t next;
+    /// Bucket the entry is in, TIMER_NONE when free
+    uint32_t bucket;
+} timer_entry_t;
+
+/// Hierarchical timing wheel, everything is protected by the mutex
+///
+/// Entries are referenced by index so that the array can grow,
+/// freed entries are kept in a free list for the next timers
+typedef struct timer_wheel_s {
+    mutex_t mutex;
+    timer_entry_t *entries;
+    uint32_t capacity;
+    uint32_t free_entries;
+    /// First entry of each bucket, the last one being TIMER_DUE_BUCKET
+    uint32_t buckets[TIMER_LEVELS * TIMER_SLOTS + 1];
+    size_t num_timers;
+    /// Last tick processed, ticks are counted from start_time
+    uint64_t now;
+    uint64_t start_time;
+    /// Tick until which the timer thread sleeps
+    uint64_t wake_tick;
+    /// Futex on which the timer thread sleeps,
+    /// incremented to wake it up earlier
+    _Atomic uint32_t epoch;
+    /// The timer thread, only started with the first timer
+    thread_t thread;
+    bool has_thread;
+    bool stop;
+} timer_wheel_t;
+
 struct thread_pool_s {
     size_t num_threads;
-    thread_t *threads;
+    thread_worker_t *workers;
+
+    // Injection queue, where tasks submitted from threads
+    // that are not part of the pool go.
+    // Either the bounded ring (when ring.cells is not NULL)
+    // or the linked list below
+    mpmc_ring_t ring;
+
+    task_node_t *first_task;
+    task_node_t *last_task;
+    // Number of tasks in the injection queue,
+    // allows to check if it is empty without locking
+    _Atomic size_t num_injected;
+    // Futex on which threads wait for room in the ring,
+    // incremented when a task is taken while some are waiting
+    _Alignas(CACHE_LINE_SIZE) _Atomic uint32_t ring_space_epoch;
+    _Atomic size_t num_blocked_producers;
+
+    // Nodes of the tasks in the injection list,
+    // only used with the mutex held
+    task_cache_t external_cache;
 
-    thread_task_t *first_task;
-    thread_task_t *last_task;
+    // NUMA nodes the workers are spread over, there is always at least one
+    pool_node_t *nodes;
+    size_t num_nodes;
+    cpu_topology_t topology;
+    // Index in nodes of each CPU id, used to find the node of a thread
+    // submitting a task, NULL when there is a single node
+    int *cpu_nodes;
+    size_t num_cpu_nodes;
 
-    thread_task_t *dangling_task;
+    // Tasks added with a priority other than normal, one list per level
+    // (the normal one is unused), protected by the mutex
+    task_list_t prio_tasks[THREAD_POOL_NUM_PRIORITIES];
+    // Bit i is set when prio_tasks[i] is not empty,
+    // allows to check the lists without locking
+    _Atomic uint32_t prio_mask;
+    // Number of times a task was looked for while low priority tasks were queued,
+    // since the last time one of them was picked
+    _Atomic uint32_t low_prio_skips;
 
-    // Mutex used for all operations
-    // and the cond var below
+    // Number of heap allocations made to submit tasks
+    _Atomic size_t num_allocations;
+    // Number of tasks dropped without running, see thread_pool_stats_s
+    _Atomic size_t num_cancelled;
+    _Atomic size_t num_expired;
+
+    // One slot per worker, plus a last one for threads outside the pool,
+    // NULL when the pool does not collect stats
+    worker_stats_t *stats;
+    // Same as stats, NULL when the pool does not record traces
+    trace_ring_t *traces;
+    // Time of the creation of the pool, traces are relative to it
+    uint64_t trace_start;
+
+    // Mutex used for the injection queue, the priority lists,
+    // the external cache and the cond var below
     mutex_t mutex;
-    // cond var on which worker thread
-    // wait to be notified of available tasks
-    condvar_t cond_task_available;
     // cond var on which 'main' thread waits
     // to know when tasks are done / threads are shutting down
     condvar_t cond_thread_done;
 
-    // Contains the number of threads that are alive
-    // (but not necessary working on some task)
-    size_t thread_count;
+    // Number of tasks submitted and not yet finished
+    _Alignas(CACHE_LINE_SIZE) _Atomic size_t pending;
+    // Number of tasks of other pools that called thread_pool_wait on the pool,
+    // they may sleep with the idle workers
+    _Atomic size_t num_waiting_tasks;
+    // Futex on which idle workers sleep,
+    // incremented each time some of them are woken up
+    _Alignas(CACHE_LINE_SIZE) _Atomic uint32_t wake_epoch;
+    // Number of workers sleeping (or about to) on wake_epoch
+    _Atomic size_t num_sleeping;
+    // Number of idle workers spinning before going to sleep
+    _Atomic size_t num_spinning;
+    // Number of workers trying to steal
+    _Atomic size_t num_searching;
+
+    // Bounds of the number of workers with a thread, num_threads being the max,
+    // the pool is elastic when min_threads != num_threads
+    size_t min_threads;
+    size_t num_active;
+    // Number of workers started at creation, compensating workers are started
+    // so that this many are not in a blocking region, when there is room
+    size_t base_threads;
+    // Number of workers in a blocking region, protected by the mutex
+    size_t num_blocked;
+    // Number of active workers above base_threads plus num_blocked,
+    // idle ones retire right away while it is not zero
+    _Atomic size_t num_surplus;
+    // Time after which an idle worker above min_threads retires
+    uint64_t idle_timeout_ns;
+    // Period of the monitor thread, spawning workers when tasks do not get
+    // picked up, only when num_active can grow
+    uint64_t spawn_delay_ns;
+    // Futex on which the monitor sleeps, set to 1 to stop it
+    _Atomic uint32_t monitor_stop;
+    // Only started when monitor_last_started is not NULL
+    thread_t monitor;
+    // Value of thread_worker_s::num_started at the last monitor tick
+    uint32_t *monitor_last_started;
+    // Delayed and periodic tasks
+    timer_wheel_t timers;
     // Threads shall stop
-    bool stop_requested;
+    _Atomic bool stop_requested;
+    // Queued tasks taken out once the pool stops, in the form given back
+    // by thread_pool_delete_ex, protected by the mutex
+    thread_pool_abandoned_task_t *abandoned_tasks;
+    size_t num_abandoned;
+    size_t abandoned_capacity;
+    // Whether the caller of thread_pool_delete_ex wants them back
+    bool keep_abandoned;
 };
 
-/// The function that each thread of the pool will run
-///
-/// When there are no task available, the thread waits
-/// otherwise it picks up and to one of the tasks
-main_thread_fn_return_t thread_fn_main(void* arg) {
-    assert(arg != NULL);
-    thread_pool_t *pool = arg;
-    int status;
-
-    while (1) {
-        status = mutex_lock(&pool->mutex);
-        if (status != 0) {
-            return 1;
-        }
-
-        while(!pool->stop_requested && pool->first_task == NULL && status == 0) {
-            status = condvar_wait(&pool->cond_task_available, &pool->mutex);
-        }
-
-        // Got woken up by and error
-        if (status != 0) {
-            status = mutex_unlock(&pool->mutex);
-            assert(status == 0);
-            return 1;
-        }
+/// Bit of thread_pool_group_s::state telling that some thread sleeps on it
+#define GROUP_HAS_WAITERS 0x80000000u
+/// Bit of thread_pool_group_s::state telling that some worker
+/// waits on it while sleeping with the idle workers
+#define GROUP_HAS_HELPERS 0x40000000u
+#define GROUP_PENDING_MASK 0x3FFFFFFFu
 
-        // Woken up because thread shall stop
-        if (pool->stop_requested) {
-            pool->thread_count -= 1;
-            status = condvar_signal(&pool->cond_thread_done);
-            assert(status == 0);
-            status = mutex_unlock(&pool->mutex);
-            assert(status == 0);
-            return 0;
-        }
+struct thread_pool_group_s {
+    _Alignas(CACHE_LINE_SIZE) thread_pool_t *pool;
+    // Number of tasks of the group not yet finished,
+    // plus GROUP_HAS_WAITERS. This is also the futex waiters sleep on.
+    _Atomic uint32_t state;
+};
 
-        // Woken up because there are some tasks to do
-        if (pool->first_task != NULL) {
-            thread_task_t *work = pool->first_task;
-            pool->first_task = work->next;
+struct thread_pool_task_handle_s {
+    thread_pool_t *pool;
+    /// A thread_pool_task_state_t, only leaves THREAD_POOL_TASK_QUEUED once
+    _Atomic uint32_t state;
+    /// One for the caller and one for the task until it is run or dropped
+    _Atomic uint32_t refs;
+};
 
-            if (pool->last_task == work) {
-                assert(pool->first_task == NULL);
-                pool->last_task = NULL;
-            }
+/// Tasks added by a running task (outside of groups), which is what
+/// thread_pool_wait waits for when called from that task
+///
+/// Created when the task adds its first task, it outlives the task
+/// when some of the tasks it added are still queued or running.
+/// Scopes are stored in task nodes, so that they are recycled like them
+typedef struct task_scope_s {
+    /// Counts the tasks not yet done, thread_pool_wait waits on it like on a group
+    thread_pool_group_t group;
+    /// One for the running task and one per task not yet done
+    _Atomic uint32_t refs;
+    /// The node holding the scope in place of a task
+    task_node_t *node;
+} task_scope_t;
 
-            status = mutex_unlock(&pool->mutex);
-            assert(status == 0);
+static_assert(sizeof(task_scope_t) <= sizeof(thread_task_t) && _Alignof(task_scope_t) <= _Alignof(task_node_t),
+              "task_scope_t must fit in a task node");
 
-            work->fn(work->arg);
+/// The task a thread is running
+typedef struct task_frame_s {
+    thread_pool_t *pool;
+    /// NULL until the task adds a task
+    task_scope_t *scope;
+} task_frame_t;
 
-            status = mutex_lock(&pool->mutex);
-            assert(status == 0);
+/// The worker the current thread is, NULL for threads not owned by a pool
+static _Thread_local thread_worker_t *current_worker = NULL;
 
-            work->next = pool->dangling_task;
-            pool->dangling_task = work;
+/// The task the current thread runs (the innermost one when it runs
+/// tasks while waiting), NULL when it runs none
+static _Thread_local task_frame_t *current_frame = NULL;
 
-            status = condvar_signal(&pool->cond_thread_done);
-            assert(status == 0);
-            status = mutex_unlock(&pool->mutex);
-            assert(status == 0);
-            continue;
-        }
+/// Number of tasks the current thread is in the middle of running,
+/// more than one when tasks are run while waiting from within a task
+static _Thread_local size_t current_task_depth = 0;
 
-        assert(0); // We should not be there
+/// Returns the worker of the calling thread if it belongs to the pool
+static thread_worker_t *pool_current_worker(const thread_pool_t *pool) {
+    thread_worker_t *worker = current_worker;
+    if (worker != NULL && worker->pool == pool) {
+        return worker;
     }
-
-    return 0;
+    return NULL;
 }
 
+/// Returns the counters of the calling thread, only when the pool collects stats
+///
+/// worker is NULL for threads that are not part of the pool
+static worker_stats_t *pool_stats_of(const thread_pool_t *pool, thread_worker_t *worker) {
+    assert(pool->stats != NULL);
+    return worker != NULL ? worker->stats : &pool->stats[pool->num_threads];
+}
 
-thread_pool_t * thread_pool_create(size_t num_threads) {
-    if (num_threads == 0) {
-        num_threads = try_get_num_threads();
+static void stats_add(const worker_stats_t *stats, _Atomic uint64_t *counter, uint64_t value) {
+    if (stats->exclusive) {
+        // No need for a read-modify-write when there is a single writer
+        uint64_t current = atomic_load_explicit(counter, memory_order_relaxed);
+        atomic_store_explicit(counter, current + value, memory_order_relaxed);
+    } else {
+        atomic_fetch_add_explicit(counter, value, memory_order_relaxed);
     }
+}
 
-    // assert msg: Cannot determine number of threads in this platform
-    // please provide a number
-    assert(num_threads != 0);
-
-    thread_pool_t *pool = malloc(sizeof(*pool));
-
-    if (pool == NULL) {
-        return NULL;
+static void stats_max(_Atomic uint64_t *counter, uint64_t value) {
+    uint64_t current = atomic_load_explicit(counter, memory_order_relaxed);
+    while (value > current
+           && !atomic_compare_exchange_weak_explicit(counter, &current, value,
+                                                     memory_order_relaxed, memory_order_relaxed)) {
     }
+}
 
-    pool->threads = malloc(sizeof(thread_t) * num_threads);
-    if (pool->threads == NULL) {
-        free(pool);
-        return NULL;
+/// Index of the histogram bucket of the duration: its number of significant bits
+static size_t stats_bucket(uint64_t ns) {
+    size_t bits;
+#if defined(__GNUC__)
+    bits = ns == 0 ? 0 : 64 - (size_t)__builtin_clzll(ns);
+#else
+    bits = 0;
+    while (ns != 0) {
+        ns >>= 1;
+        bits += 1;
     }
-    pool->num_threads = num_threads;
-    pool->stop_requested = 0;
-    pool->first_task = NULL;
-    pool->last_task = NULL;
-    pool->dangling_task = NULL;
+#endif
+    return bits < THREAD_POOL_STATS_BUCKETS ? bits : THREAD_POOL_STATS_BUCKETS - 1;
+}
 
-    if (mutex_init(&pool->mutex) != 0) {
-        free(pool->threads);
-        free(pool);
-        return NULL;
+/// Locks the pool's mutex, accounting for the time spent waiting for it
+static int pool_lock(thread_pool_t *pool) {
+    if (pool->stats == NULL) {
+        return mutex_lock(&pool->mutex);
     }
+    uint64_t start = get_time_ns();
+    int status = mutex_lock(&pool->mutex);
+    worker_stats_t *stats = pool_stats_of(pool, pool_current_worker(pool));
+    stats_add(stats, &stats->lock_wait_ns, get_time_ns() - start);
+    return status;
+}
 
-    if (condvar_init(&pool->cond_task_available) != 0) {
-        free(pool->threads);
-        free(pool);
-        return NULL;
-    }
+/// Whether the time tasks are queued must be recorded
+static bool pool_stamps_tasks(const thread_pool_t *pool) {
+    return pool->stats != NULL || pool->traces != NULL;
+}
 
-    if (condvar_init(&pool->cond_thread_done) != 0) {
-        free(pool->threads);
-        free(pool);
-        return NULL;
+/// Records a task that ran in the ring of the calling thread
+static void pool_trace_task(thread_pool_t *pool, thread_worker_t *worker, const thread_task_t *task,
+                            uint64_t start, uint64_t end) {
+    trace_ring_t *ring = &pool->traces[worker != NULL ? worker->index : pool->num_threads];
+    uint64_t n;
+    if (ring->exclusive) {
+        n = atomic_load_explicit(&ring->head, memory_order_relaxed);
+        atomic_store_explicit(&ring->head, n + 1, memory_order_relaxed);
+    } else {
+        n = atomic_fetch_add_explicit(&ring->head, 1, memory_order_relaxed);
     }
 
-    // Lock ourselves while we are creating threads
-    if (mutex_lock(&pool->mutex) != 0) {
-        free(pool->threads);
-        free(pool);
-        return NULL;
-    }
+    trace_event_t *event = &ring->events[n & ring->mask];
+    atomic_store_explicit(&event->sequence, 2 * n + 1, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+    atomic_store_explicit(&event->enqueue_time, task->enqueue_time, memory_order_relaxed);
+    atomic_store_explicit(&event->start, start, memory_order_relaxed);
+    atomic_store_explicit(&event->end, end, memory_order_relaxed);
+    atomic_store_explicit(&event->label, task->label, memory_order_relaxed);
+    atomic_store_explicit(&event->sequence, 2 * n + 2, memory_order_release);
+}
 
-    pool->thread_count = 0;
-    for (size_t i = 0; i < pool->num_threads; i++) {
-        int status = thread_create(&pool->threads[i], thread_fn_main, pool);
-        assert(status == 0);
-        pool->thread_count += 1;
+/// Returns a copy of the task stamped with the time it is queued,
+/// or the task itself when the pool neither collects stats nor records traces
+static const thread_task_t *pool_stamp_task(const thread_pool_t *pool, const thread_task_t *task,
+                                            thread_task_t *copy) {
+    if (!pool_stamps_tasks(pool)) {
+        return task;
     }
-    assert(mutex_unlock(&pool->mutex) == 0);
-
-
-    return pool;
+    *copy = *task;
+    copy->enqueue_time = get_time_ns();
+    return copy;
 }
 
-void thread_pool_wait(thread_pool_t *pool) {
-    assert(pool != NULL);
+/// Records the number of tasks in a queue the calling thread just pushed to
+static void pool_record_queue_depth(thread_pool_t *pool, thread_worker_t *worker, size_t depth) {
+    if (pool->stats != NULL) {
+        stats_max(&pool_stats_of(pool, worker)->max_queue_depth, depth);
+    }
+}
 
-    int status;
-    status = mutex_lock(&pool->mutex);
-    if (status != 0) {
-        return;
+static task_array_t *task_array_create(int64_t capacity) {
+    task_array_t *array = malloc(sizeof(*array) + sizeof(array->tasks[0]) * (size_t)capacity);
+    if (array == NULL) {
+        return NULL;
     }
+    array->capacity = capacity;
+    array->retired = NULL;
+    return array;
+}
 
-    while (((pool->thread_count != 0 && pool->stop_requested) || pool->first_task != NULL) && status == 0) {
-        status = condvar_wait(&pool->cond_thread_done, &pool->mutex);
+static int task_deque_init(task_deque_t *deque) {
+    task_array_t *array = task_array_create(TASK_DEQUE_INITIAL_CAPACITY);
+    if (array == NULL) {
+        return 1;
     }
-    mutex_unlock(&pool->mutex);
+    atomic_init(&deque->top, 0);
+    atomic_init(&deque->bottom, 0);
+    atomic_init(&deque->array, array);
+    return 0;
 }
 
-void thread_pool_add_task(thread_pool_t *pool, thread_task_fn_t *fn, void* arg)
-{
-    assert(pool != NULL);
+static void task_deque_destroy(task_deque_t *deque) {
+    task_array_t *array = atomic_load_explicit(&deque->array, memory_order_relaxed);
+    while (array != NULL) {
+        task_array_t *retired = array->retired;
+        free(array);
+        array = retired;
+    }
+}
 
-    int status = mutex_lock(&pool->mutex);
+/// Only called by the owner of the deque,
+/// returns true if the deque had to allocate memory to grow
+static bool task_deque_push(task_deque_t *deque, task_node_t *task) {
+    int64_t b = atomic_load_explicit(&deque->bottom, memory_order_relaxed);
+    int64_t t = atomic_load_explicit(&deque->top, memory_order_acquire);
+    task_array_t *array = atomic_load_explicit(&deque->array, memory_order_relaxed);
+    bool grew = false;
 
-    thread_task_t *work;
-    if (pool->dangling_task != NULL) {
-        work = pool->dangling_task;
-        pool->dangling_task = work->next;
-    } else {
-        work = malloc(sizeof(*work));
-        assert(work != NULL);
+    if (b - t > array->capacity - 1) {
+        task_array_t *bigger = task_array_create(array->capacity * 2);
+        assert(bigger != NULL);
+        for (int64_t i = t; i < b; ++i) {
+            task_node_t *moved = atomic_load_explicit(&array->tasks[i & (array->capacity - 1)], memory_order_relaxed);
+            atomic_store_explicit(&bigger->tasks[i & (bigger->capacity - 1)], moved, memory_order_relaxed);
+        }
+        bigger->retired = array;
+        atomic_store_explicit(&deque->array, bigger, memory_order_release);
+        array = bigger;
+        grew = true;
     }
 
-    work->next = NULL;
-    work->arg = arg;
-    work->fn = fn;
+    atomic_store_explicit(&array->tasks[b & (array->capacity - 1)], task, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+    atomic_store_explicit(&deque->bottom, b + 1, memory_order_relaxed);
+    return grew;
+}
 
-    assert(status == 0);
+/// Only called by the owner of the deque, returns NULL if empty
+static task_node_t *task_deque_take(task_deque_t *deque) {
+    int64_t b = atomic_load_explicit(&deque->bottom, memory_order_relaxed) - 1;
+    task_array_t *array = atomic_load_explicit(&deque->array, memory_order_relaxed);
+    atomic_store_explicit(&deque->bottom, b, memory_order_relaxed);
+    atomic_thread_fence(memory_order_seq_cst);
+    int64_t t = atomic_load_explicit(&deque->top, memory_order_relaxed);
 
-    if (pool->last_task == NULL) {
-        assert(pool->first_task == NULL);
-        pool->first_task = pool->last_task = work;
+    task_node_t *task = NULL;
+    if (t <= b) {
+        task = atomic_load_explicit(&array->tasks[b & (array->capacity - 1)], memory_order_relaxed);
+        if (t == b) {
+            // Last task, race against thieves
+            if (!atomic_compare_exchange_strong_explicit(&deque->top, &t, t + 1,
+                                                         memory_order_seq_cst, memory_order_relaxed)) {
+                task = NULL;
+            }
+            atomic_store_explicit(&deque->bottom, b + 1, memory_order_relaxed);
+        }
     } else {
-        pool->last_task->next = work;
-        pool->last_task = work;
+        atomic_store_explicit(&deque->bottom, b + 1, memory_order_relaxed);
     }
-
-    // Tells waiting threads that a task arrived
-    status = condvar_broadcast(&pool->cond_task_available);
-    assert(status == 0);
-    status = mutex_unlock(&pool->mutex);
-    assert(status == 0);
+    return task;
 }
 
-void thread_pool_delete(thread_pool_t *pool)
-{
-    if (pool == NULL) {
-        return;
+/// Called by any thread, returns NULL if empty or TASK_DEQUE_ABORT
+/// if another thread took the task first
+static task_node_t *task_deque_steal(task_deque_t *deque) {
+    int64_t t = atomic_load_explicit(&deque->top, memory_order_acquire);
+    atomic_thread_fence(memory_order_seq_cst);
+    int64_t b = atomic_load_explicit(&deque->bottom, memory_order_acquire);
+
+    if (t >= b) {
+        return NULL;
     }
 
-    int status;
-    status = mutex_lock(&pool->mutex);
-    if (status != 0) {
-        // this is kinda bad no ?
-        return;
+    task_array_t *array = atomic_load_explicit(&deque->array, memory_order_acquire);
+    task_node_t *task = atomic_load_explicit(&array->tasks[t & (array->capacity - 1)], memory_order_relaxed);
+    if (!atomic_compare_exchange_strong_explicit(&deque->top, &t, t + 1,
+                                                 memory_order_seq_cst, memory_order_relaxed)) {
+        return TASK_DEQUE_ABORT;
     }
+    return task;
+}
 
-    pool->stop_requested = true;
+/// Number of tasks in the deque, only a hint when read by other threads
+static size_t task_deque_size(task_deque_t *deque) {
+    int64_t t = atomic_load_explicit(&deque->top, memory_order_relaxed);
+    int64_t b = atomic_load_explicit(&deque->bottom, memory_order_relaxed);
+    return b > t ? (size_t)(b - t) : 0;
+}
 
-    status = condvar_broadcast(&pool->cond_task_available);
-    assert(status == 0);
-    status = mutex_unlock(&pool->mutex);
-    assert(status == 0);
+static bool task_deque_is_empty(task_deque_t *deque) {
+    int64_t t = atomic_load_explicit(&deque->top, memory_order_relaxed);
+    int64_t b = atomic_load_explicit(&deque->bottom, memory_order_relaxed);
+    return b <= t;
+}
 
-    thread_pool_wait(pool);
+static mpmc_ring_cell_t *mpmc_ring_cell(mpmc_ring_t *ring, size_t pos) {
+    return (mpmc_ring_cell_t *)(ring->cells + (pos & ring->mask) * ring->cell_size);
+}
 
-    mutex_destroy(&pool->mutex);
-    condvar_destroy(&pool->cond_task_available);
-    condvar_destroy(&pool->cond_thread_done);
-    for (size_t i = 0; i < pool->num_threads; ++i) {
-        thread_destroy(&pool->threads[i]);
+int mpmc_ring_init(mpmc_ring_t *ring, size_t capacity, size_t item_size) {
+    size_t rounded = 2;
+    while (rounded < capacity) {
+        rounded *= 2;
     }
-    free(pool->threads);
 
-    thread_task_t *work = pool->dangling_task;
-    while (work != NULL) {
-        thread_task_t *next = work->next;
-        free(work);
-        work = next;
+    size_t alignment = _Alignof(mpmc_ring_cell_t);
+    ring->cell_size = (sizeof(mpmc_ring_cell_t) + item_size + alignment - 1) & ~(alignment - 1);
+    ring->item_size = item_size;
+    ring->cells = aligned_malloc(CACHE_LINE_SIZE, ring->cell_size * rounded);
+    if (ring->cells == NULL) {
+        return 1;
     }
-    free(pool);
+    ring->mask = rounded - 1;
+    for (size_t i = 0; i < rounded; ++i) {
+        atomic_init(&mpmc_ring_cell(ring, i)->sequence, i);
+    }
+    atomic_init(&ring->enqueue_pos, 0);
+    atomic_init(&ring->dequeue_pos, 0);
+    return 0;
+}
+
+void mpmc_ring_destroy(mpmc_ring_t *ring) {
+    aligned_free(ring->cells);
+    ring->cells = NULL;
+}
+
+bool mpmc_ring_try_push(mpmc_ring_t *ring, const void *item) {
+    size_t pos = atomic_load_explicit(&ring->enqueue_pos, memory_order_relaxed);
+    mpmc_ring_cell_t *cell;
+    while (1) {
+        cell = mpmc_ring_cell(ring, pos);
+        size_t sequence = atomic_load_explicit(&cell->sequence, memory_order_acquire);
+        intptr_t diff = (intptr_t)sequence - (intptr_t)pos;
+        if (diff == 0) {
+            if (atomic_compare_exchange_weak_explicit(&ring->enqueue_pos, &pos, pos + 1,
+                                                      memory_order_relaxed, memory_order_relaxed)) {
+                break;
+            }
+        } else if (diff < 0) {
+            // The consumer of the previous lap has not freed the cell yet
+            return false;
+        } else {
+            pos = atomic_load_explicit(&ring->enqueue_pos, memory_order_relaxed);
+        }
+    }
+
+    memcpy(cell->item, item, ring->item_size);
+    atomic_store_explicit(&cell->sequence, pos + 1, memory_order_release);
+    return true;
+}
+
+bool mpmc_ring_try_pop(mpmc_ring_t *ring, void *item) {
+    size_t pos = atomic_load_explicit(&ring->dequeue_pos, memory_order_relaxed);
+    mpmc_ring_cell_t *cell;
+    while (1) {
+        cell = mpmc_ring_cell(ring, pos);
+        size_t sequence = atomic_load_explicit(&cell->sequence, memory_order_acquire);
+        intptr_t diff = (intptr_t)sequence - (intptr_t)(pos + 1);
+        if (diff == 0) {
+            if (atomic_compare_exchange_weak_explicit(&ring->dequeue_pos, &pos, pos + 1,
+                                                      memory_order_relaxed, memory_order_relaxed)) {
+                break;
+            }
+        } else if (diff < 0) {
+            return false;
+        } else {
+            pos = atomic_load_explicit(&ring->dequeue_pos, memory_order_relaxed);
+        }
+    }
+
+    memcpy(item, cell->item, ring->item_size);
+    atomic_store_explicit(&cell->sequence, pos + ring->mask + 1, memory_order_release);
+    return true;
+}
+
+bool mpmc_ring_is_empty(mpmc_ring_t *ring) {
+    size_t dequeue_pos = atomic_load_explicit(&ring->dequeue_pos, memory_order_relaxed);
+    size_t enqueue_pos = atomic_load_explicit(&ring->enqueue_pos, memory_order_relaxed);
+    return enqueue_pos == dequeue_pos;
+}
+
+size_t mpmc_ring_size(mpmc_ring_t *ring) {
+    size_t enqueue_pos = atomic_load_explicit(&ring->enqueue_pos, memory_order_relaxed);
+    size_t dequeue_pos = atomic_load_explicit(&ring->dequeue_pos, memory_order_relaxed);
+    return enqueue_pos > dequeue_pos ? enqueue_pos - dequeue_pos : 0;
+}
+
+void *grow_array(void *items, size_t *capacity, size_t size, size_t item_size) {
+    if (size < *capacity) {
+        return items;
+    }
+
+    size_t new_capacity = *capacity == 0 ? 4 : *capacity * 2;
+    void *new_items = realloc(items, new_capacity * item_size);
+    if (new_items != NULL) {
+        *capacity = new_capacity;
+    }
+    return new_items;
+}
+
+/// xorshift64, good enough to pick victims
+static uint64_t random_next(uint64_t *state) {
+    uint64_t x = *state;
+    x ^= x << 13;
+    x ^= x >> 7;
+    x ^= x << 17;
+    *state = x;
+    return x;
+}
+
+static void task_cache_init(task_cache_t *cache) {
+    cache->free_nodes = NULL;
+    cache->slabs = NULL;
+    atomic_init(&cache->remote_free_nodes, NULL);
+}
+
+static void task_cache_destroy(task_cache_t *cache) {
+    task_slab_t *slab = cache->slabs;
+    while (slab != NULL) {
+        task_slab_t *next = slab->next;
+        aligned_free(slab);
+        slab = next;
+    }
+}
+
+/// Gets a node from the cache, only called by the owner of the cache
+///
+/// \return NULL when out of memory
+static task_node_t *task_cache_try_alloc(thread_pool_t *pool, task_cache_t *cache) {
+    task_node_t *node = cache->free_nodes;
+    if (node == NULL) {
+        node = atomic_exchange_explicit(&cache->remote_free_nodes, NULL, memory_order_acquire);
+    }
+    if (node == NULL) {
+        task_slab_t *slab = aligned_malloc(_Alignof(task_slab_t), sizeof(*slab));
+        if (slab == NULL) {
+            return NULL;
+        }
+        atomic_fetch_add_explicit(&pool->num_allocations, 1, memory_order_relaxed);
+        slab->next = cache->slabs;
+        cache->slabs = slab;
+
+        for (size_t i = 0; i < TASK_SLAB_SIZE; ++i) {
+            slab->nodes[i].owner = cache;
+            slab->nodes[i].next = i + 1 < TASK_SLAB_SIZE ? &slab->nodes[i + 1] : NULL;
+        }
+        node = &slab->nodes[0];
+    }
+    cache->free_nodes = node->next;
+    return node;
+}
+
+static task_node_t *task_cache_alloc(thread_pool_t *pool, task_cache_t *cache) {
+    task_node_t *node = task_cache_try_alloc(pool, cache);
+    assert(node != NULL);
+    return node;
+}
+
+/// Gives nodes back to the cache that owns them, from any thread
+static void task_cache_free_remote(task_cache_t *cache, task_node_t *first, task_node_t *last) {
+    task_node_t *head = atomic_load_explicit(&cache->remote_free_nodes, memory_order_relaxed);
+    do {
+        last->next = head;
+    } while (!atomic_compare_exchange_weak_explicit(&cache->remote_free_nodes, &head, first,
+                                                    memory_order_release, memory_order_relaxed));
+}
+
+static void task_free_batch_flush(task_free_batch_t *batch) {
+    if (batch->count == 0) {
+        return;
+    }
+    task_cache_free_remote(batch->owner, batch->first, batch->last);
+    batch->owner = NULL;
+    batch->first = NULL;
+    batch->last = NULL;
+    batch->count = 0;
+}
+
+/// Gives a node back once its task was copied out
+///
+/// worker is NULL for threads that are not part of the pool
+static void task_node_free(thread_worker_t *worker, task_node_t *node) {
+    if (worker == NULL) {
+        task_cache_free_remote(node->owner, node, node);
+        return;
+    }
+
+    if (node->owner == &worker->cache) {
+        node->next = worker->cache.free_nodes;
+        worker->cache.free_nodes = node;
+        return;
+    }
+
+    task_free_batch_t *batch = &worker->free_batch;
+    if (batch->owner != node->owner) {
+        task_free_batch_flush(batch);
+        batch->owner = node->owner;
+    }
+    node->next = batch->first;
+    batch->first = node;
+    if (batch->last == NULL) {
+        batch->last = node;
+    }
+    batch->count += 1;
+    if (batch->count == TASK_FREE_BATCH_SIZE) {
+        task_free_batch_flush(batch);
+    }
+}
+
+/// Pops a task from the injection queue, returns false if empty
+static bool pool_pop_injected(thread_pool_t *pool, thread_task_t *task) {
+    if (pool->ring.cells != NULL) {
+        if (!mpmc_ring_try_pop(&pool->ring, task)) {
+            return false;
+        }
+        // Pairs with the fence in pool_ring_push:
+        // either we see the producer, or it sees the room we made
+        atomic_thread_fence(memory_order_seq_cst);
+        if (atomic_load_explicit(&pool->num_blocked_producers, memory_order_relaxed) != 0) {
+            atomic_fetch_add_explicit(&pool->ring_space_epoch, 1, memory_order_seq_cst);
+            futex_wake_one(&pool->ring_space_epoch);
+        }
+        return true;
+    }
+
+    if (atomic_load_explicit(&pool->num_injected, memory_order_relaxed) == 0) {
+        return false;
+    }
+
+    int status = pool_lock(pool);
+    assert(status == 0);
+    task_node_t *work = pool->first_task;
+    if (work != NULL) {
+        pool->first_task = work->next;
+        if (pool->last_task == work) {
+            assert(pool->first_task == NULL);
+            pool->last_task = NULL;
+        }
+        atomic_fetch_sub_explicit(&pool->num_injected, 1, memory_order_relaxed);
+
+        // The external cache is only used under the mutex, which we hold
+        assert(work->owner == &pool->external_cache);
+        *task = work->task;
+        work->next = pool->external_cache.free_nodes;
+        pool->external_cache.free_nodes = work;
+    }
+    status = mutex_unlock(&pool->mutex);
+    assert(status == 0);
+    (void)status;
+    return work != NULL;
+}
+
+/// Low priority tasks jump ahead of the others once they were
+/// passed over that many times, so that they cannot starve
+#define LOW_PRIORITY_AGING_LIMIT 64
+
+static void task_list_push(task_list_t *list, task_node_t *node) {
+    node->next = NULL;
+    if (list->last == NULL) {
+        assert(list->first == NULL);
+        list->first = list->last = node;
+    } else {
+        list->last->next = node;
+        list->last = node;
+    }
+}
+
+static task_node_t *task_list_pop(task_list_t *list) {
+    task_node_t *node = list->first;
+    if (node != NULL) {
+        list->first = node->next;
+        if (list->last == node) {
+            assert(list->first == NULL);
+            list->last = NULL;
+        }
+    }
+    return node;
+}
+
+/// Pops a task from the list of the priority level
+static bool pool_pop_prio(thread_pool_t *pool, thread_pool_priority_t priority, thread_task_t *task) {
+    uint32_t bit = 1u << priority;
+    if ((atomic_load_explicit(&pool->prio_mask, memory_order_relaxed) & bit) == 0) {
+        return false;
+    }
+
+    int status = pool_lock(pool);
+    assert(status == 0);
+    task_list_t *list = &pool->prio_tasks[priority];
+    task_node_t *work = task_list_pop(list);
+    if (work != NULL) {
+        if (list->first == NULL) {
+            atomic_fetch_and_explicit(&pool->prio_mask, ~bit, memory_order_relaxed);
+        }
+        *task = work->task;
+        work->next = pool->external_cache.free_nodes;
+        pool->external_cache.free_nodes = work;
+    }
+    status = mutex_unlock(&pool->mutex);
+    assert(status == 0);
+    (void)status;
+    return work != NULL;
+}
+
+/// Pops a task from the list of the node
+static bool pool_pop_node(thread_pool_t *pool, size_t node_index, thread_task_t *task) {
+    pool_node_t *node = &pool->nodes[node_index];
+    if (atomic_load_explicit(&node->num_tasks, memory_order_relaxed) == 0) {
+        return false;
+    }
+
+    int status = pool_lock(pool);
+    assert(status == 0);
+    task_node_t *work = task_list_pop(&node->tasks);
+    if (work != NULL) {
+        atomic_fetch_sub_explicit(&node->num_tasks, 1, memory_order_relaxed);
+        *task = work->task;
+        work->next = pool->external_cache.free_nodes;
+        pool->external_cache.free_nodes = work;
+    }
+    status = mutex_unlock(&pool->mutex);
+    assert(status == 0);
+    (void)status;
+    return work != NULL;
+}
+
+/// Pops a task from the list of any node other than the worker's one
+///
+/// worker is NULL for threads that are not part of the pool
+static bool pool_pop_other_nodes(thread_pool_t *pool, thread_worker_t *worker, thread_task_t *task) {
+    for (size_t i = 0; i < pool->num_nodes; ++i) {
+        if ((worker == NULL || i != worker->node) && pool_pop_node(pool, i, task)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/// Tries to steal a task from workers[first, first + count), starting at a random victim
+///
+/// thief is NULL for threads that are not part of the pool
+static task_node_t *pool_steal_from(thread_pool_t *pool, thread_worker_t *thief, uint64_t *rng_state,
+                                    size_t first, size_t count) {
+    if (count == 0 || (count == 1 && thief == &pool->workers[first])) {
+        return NULL;
+    }
+
+    bool contended;
+    do {
+        contended = false;
+        size_t start = (size_t)(random_next(rng_state) % count);
+        for (size_t i = 0; i < count; ++i) {
+            thread_worker_t *victim = &pool->workers[first + (start + i) % count];
+            if (victim == thief) {
+                continue;
+            }
+            task_node_t *task = task_deque_steal(&victim->deque);
+            if (task == TASK_DEQUE_ABORT) {
+                contended = true;
+            } else if (task != NULL) {
+                return task;
+            }
+        }
+    } while (contended);
+
+    return NULL;
+}
+
+/// Tries to steal a task from the workers,
+/// workers of the thief's NUMA node first
+///
+/// thief is NULL for threads that are not part of the pool
+static task_node_t *pool_steal(thread_pool_t *pool, thread_worker_t *thief, uint64_t *rng_state) {
+    if (thief != NULL && pool->num_nodes > 1) {
+        pool_node_t *node = &pool->nodes[thief->node];
+        task_node_t *task = pool_steal_from(pool, thief, rng_state, node->first_worker, node->num_workers);
+        if (task != NULL) {
+            return task;
+        }
+    }
+    return pool_steal_from(pool, thief, rng_state, 0, pool->num_threads);
+}
+
+/// Looks for a task: high priority ones first, then own deque and node (for workers),
+/// then the injection queue, then the workers' deques, then other nodes
+/// and last low priority ones
+///
+/// The task is copied to the output so that its node can be reused right away
+static bool pool_find_task(thread_pool_t *pool, thread_worker_t *worker, uint64_t *rng_state, thread_task_t *task) {
+    uint32_t prio_mask = atomic_load_explicit(&pool->prio_mask, memory_order_relaxed);
+    if (prio_mask != 0) {
+        if ((prio_mask & (1u << THREAD_POOL_PRIORITY_LOW)) != 0
+            && atomic_fetch_add_explicit(&pool->low_prio_skips, 1, memory_order_relaxed) + 1 >= LOW_PRIORITY_AGING_LIMIT) {
+            atomic_store_explicit(&pool->low_prio_skips, 0, memory_order_relaxed);
+            if (pool_pop_prio(pool, THREAD_POOL_PRIORITY_LOW, task)) {
+                return true;
+            }
+        }
+        if (pool_pop_prio(pool, THREAD_POOL_PRIORITY_HIGH, task)) {
+            return true;
+        }
+    }
+
+    task_node_t *work = NULL;
+    if (worker != NULL) {
+        work = task_deque_take(&worker->deque);
+        if (work == NULL && pool_pop_node(pool, worker->node, task)) {
+            return true;
+        }
+    }
+    if (work == NULL && pool_pop_injected(pool, task)) {
+        return true;
+    }
+    if (work == NULL) {
+        // Lets tasks that could be split know that someone wants work
+        atomic_fetch_add_explicit(&pool->num_searching, 1, memory_order_relaxed);
+        work = pool_steal(pool, worker, rng_state);
+        atomic_fetch_sub_explicit(&pool->num_searching, 1, memory_order_relaxed);
+        if (work != NULL && pool->stats != NULL) {
+            worker_stats_t *stats = pool_stats_of(pool, worker);
+            stats_add(stats, &stats->tasks_stolen, 1);
+        }
+    }
+    if (work == NULL) {
+        if (pool_pop_other_nodes(pool, worker, task)) {
+            return true;
+        }
+        if (pool_pop_prio(pool, THREAD_POOL_PRIORITY_LOW, task)) {
+            atomic_store_explicit(&pool->low_prio_skips, 0, memory_order_relaxed);
+            return true;
+        }
+        return false;
+    }
+    *task = work->task;
+    task_node_free(worker, work);
+    return true;
+}
+
+/// Returns whether some task is waiting to be picked up somewhere
+static bool pool_has_queued_tasks(thread_pool_t *pool) {
+    if (atomic_load_explicit(&pool->prio_mask, memory_order_relaxed) != 0) {
+        return true;
+    }
+    for (size_t i = 0; i < pool->num_nodes; ++i) {
+        if (atomic_load_explicit(&pool->nodes[i].num_tasks, memory_order_relaxed) != 0) {
+            return true;
+        }
+    }
+    if (pool->ring.cells != NULL) {
+        if (!mpmc_ring_is_empty(&pool->ring)) {
+            return true;
+        }
+    } else if (atomic_load_explicit(&pool->num_injected, memory_order_relaxed) != 0) {
+        return true;
+    }
+    for (size_t i = 0; i < pool->num_threads; ++i) {
+        if (!task_deque_is_empty(&pool->workers[i].deque)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/// Wakes up all the sleeping workers, when they may all have something to do
+static void pool_wake_all(thread_pool_t *pool) {
+    atomic_fetch_add_explicit(&pool->wake_epoch, 1, memory_order_seq_cst);
+    futex_wake_all(&pool->wake_epoch);
+}
+
+/// Wakes up to count sleeping workers after tasks were made available
+static void pool_notify_tasks_available(thread_pool_t *pool, size_t count) {
+    // Pairs with the fence in worker_sleep: either we see the sleeper,
+    // or the sleeper sees the tasks we just pushed
+    atomic_thread_fence(memory_order_seq_cst);
+
+    // Spinning workers are about to find the tasks,
+    // they check for tasks again (after the fence) if they go to sleep
+    size_t num_spinning = atomic_load_explicit(&pool->num_spinning, memory_order_relaxed);
+    if (num_spinning >= count) {
+        return;
+    }
+    count -= num_spinning;
+
+    size_t num_sleeping = atomic_load_explicit(&pool->num_sleeping, memory_order_relaxed);
+    if (num_sleeping == 0) {
+        return;
+    }
+
+    atomic_fetch_add_explicit(&pool->wake_epoch, 1, memory_order_seq_cst);
+    if (count >= num_sleeping) {
+        futex_wake_all(&pool->wake_epoch);
+    } else {
+        for (size_t i = 0; i < count; ++i) {
+            futex_wake_one(&pool->wake_epoch);
+        }
+    }
+}
+
+/// Marks one task as finished, waking up threads waiting on the pool
+/// when it was the last one
+static void pool_task_done(thread_pool_t *pool) {
+    size_t previous = atomic_fetch_sub_explicit(&pool->pending, 1, memory_order_seq_cst);
+    if (previous != 1) {
+        return;
+    }
+
+    if (atomic_load_explicit(&pool->num_waiting_tasks, memory_order_seq_cst) != 0) {
+        // Tasks waiting on the pool sleep like idle workers
+        pool_wake_all(pool);
+    }
+
+    int status = mutex_lock(&pool->mutex);
+    assert(status == 0);
+    status = condvar_broadcast(&pool->cond_thread_done);
+    assert(status == 0);
+    status = mutex_unlock(&pool->mutex);
+    assert(status == 0);
+    (void)status;
+}
+
+static void group_init(thread_pool_group_t *group, thread_pool_t *pool) {
+    group->pool = pool;
+    atomic_init(&group->state, 0);
+}
+
+/// Accounts for count tasks about to be added to the group
+static void group_add(thread_pool_group_t *group, size_t count) {
+    uint32_t previous = atomic_fetch_add_explicit(&group->state, (uint32_t)count, memory_order_relaxed);
+    // assert msg: Too many pending tasks in the group
+    assert(count <= GROUP_PENDING_MASK && (previous & GROUP_PENDING_MASK) + count <= GROUP_PENDING_MASK);
+    (void)previous;
+}
+
+/// Marks one task of the group as finished, waking up waiters when it was the last one
+static void group_task_done(thread_pool_group_t *group) {
+    // The group may be freed by a waiter as soon as the count reaches zero
+    thread_pool_t *pool = group->pool;
+    uint32_t previous = atomic_fetch_sub_explicit(&group->state, 1, memory_order_acq_rel);
+    if ((previous & GROUP_PENDING_MASK) != 1) {
+        return;
+    }
+
+    if (previous & GROUP_HAS_WAITERS) {
+        // Waking on the address of a freed group is harmless
+        futex_wake_all(&group->state);
+    }
+    if (previous & GROUP_HAS_HELPERS) {
+        pool_wake_all(pool);
+    }
+}
+
+/// Gets the scope of the task the calling thread runs, for the tasks
+/// it adds to the pool, creating it when needed
+///
+/// *scope is set to NULL when the thread does not run a task of the pool
+/// \return false when out of memory
+static bool pool_current_scope(thread_pool_t *pool, task_scope_t **scope) {
+    task_frame_t *frame = current_frame;
+    *scope = NULL;
+    if (frame == NULL || frame->pool != pool) {
+        return true;
+    }
+    if (frame->scope == NULL) {
+        thread_worker_t *worker = pool_current_worker(pool);
+        task_node_t *node;
+        if (worker != NULL) {
+            node = task_cache_try_alloc(pool, &worker->cache);
+        } else {
+            int status = pool_lock(pool);
+            assert(status == 0);
+            node = task_cache_try_alloc(pool, &pool->external_cache);
+            status = mutex_unlock(&pool->mutex);
+            assert(status == 0);
+            (void)status;
+        }
+        if (node == NULL) {
+            return false;
+        }
+        task_scope_t *new_scope = (task_scope_t *)&node->task;
+        group_init(&new_scope->group, pool);
+        atomic_init(&new_scope->refs, 1);
+        new_scope->node = node;
+        frame->scope = new_scope;
+    }
+    *scope = frame->scope;
+    return true;
+}
+
+/// Accounts for count tasks about to be added to the scope
+static void task_scope_add(task_scope_t *scope, size_t count) {
+    atomic_fetch_add_explicit(&scope->refs, (uint32_t)count, memory_order_relaxed);
+    group_add(&scope->group, count);
+}
+
+static void task_scope_release(task_scope_t *scope) {
+    if (atomic_fetch_sub_explicit(&scope->refs, 1, memory_order_acq_rel) == 1) {
+        task_node_free(pool_current_worker(scope->group.pool), scope->node);
+    }
+}
+
+/// Marks a task of the scope as finished, run or dropped
+static void task_scope_task_done(task_scope_t *scope) {
+    group_task_done(&scope->group);
+    task_scope_release(scope);
+}
+
+/// Makes the task part of the scope of the task adding it, if any
+///
+/// Tasks of a group are waited for through their group instead
+/// \return NULL when out of memory, see pool_run_task_now
+static const thread_task_t *pool_scope_task(thread_pool_t *pool, const thread_task_t *task, thread_task_t *copy) {
+    if (task->group != NULL || current_frame == NULL) {
+        return task;
+    }
+    task_scope_t *scope;
+    if (!pool_current_scope(pool, &scope)) {
+        return NULL;
+    }
+    if (scope == NULL) {
+        return task;
+    }
+    task_scope_add(scope, 1);
+    if (task != copy) {
+        *copy = *task;
+    }
+    copy->scope = scope;
+    return copy;
+}
+
+/// Blocks until the group's tasks are done, without running any
+static void group_block(thread_pool_group_t *group) {
+    uint32_t state = atomic_load_explicit(&group->state, memory_order_acquire);
+    while ((state & GROUP_PENDING_MASK) != 0) {
+        if ((state & GROUP_HAS_WAITERS) == 0
+            && !atomic_compare_exchange_weak_explicit(&group->state, &state, state | GROUP_HAS_WAITERS,
+                                                      memory_order_acquire, memory_order_acquire)) {
+            continue;
+        }
+        futex_wait(&group->state, state | GROUP_HAS_WAITERS);
+        state = atomic_load_explicit(&group->state, memory_order_acquire);
+    }
+}
+
+/// Leaves the group clean for the next round of tasks,
+/// if this fails a later completion just makes a useless wake up
+static void group_clear_waiter_bits(thread_pool_group_t *group) {
+    uint32_t state = atomic_load_explicit(&group->state, memory_order_relaxed);
+    while (state != 0 && (state & GROUP_PENDING_MASK) == 0) {
+        if (atomic_compare_exchange_weak_explicit(&group->state, &state, 0,
+                                                  memory_order_relaxed, memory_order_relaxed)) {
+            break;
+        }
+    }
+}
+
+/// Size of the first chunk of scratch arenas of threads that are not workers
+#define SCRATCH_DEFAULT_SIZE (64 * 1024)
+
+/// Scratch arena of a thread that is not a worker, used by the tasks it runs
+/// while waiting. It is freed when its outermost task returns, as nothing
+/// would free it when the thread exits
+static _Thread_local scratch_arena_t external_scratch = {
+    .first = NULL,
+    .current = NULL,
+    .used = 0,
+    .chunk_size = SCRATCH_DEFAULT_SIZE,
+};
+
+/// Position in a scratch arena, to rewind it
+typedef struct scratch_mark_s {
+    scratch_chunk_t *chunk;
+    size_t used;
+} scratch_mark_t;
+
+static scratch_mark_t scratch_arena_mark(const scratch_arena_t *arena) {
+    scratch_mark_t mark = {
+        .chunk = arena->current,
+        .used = arena->used,
+    };
+    return mark;
+}
+
+/// Frees everything allocated since the mark, keeping the chunks
+static void scratch_arena_rewind(scratch_arena_t *arena, scratch_mark_t mark) {
+    arena->current = mark.chunk != NULL ? mark.chunk : arena->first;
+    arena->used = mark.chunk != NULL ? mark.used : 0;
+}
+
+/// \return The memory, aligned for any type, or NULL in case of error
+static void *scratch_arena_alloc(scratch_arena_t *arena, size_t size) {
+    const size_t alignment = _Alignof(max_align_t);
+    if (size > SIZE_MAX - alignment) {
+        return NULL;
+    }
+    size = (size + alignment - 1) & ~(alignment - 1);
+
+    scratch_chunk_t *chunk = arena->current;
+    if (chunk == NULL || chunk->size - arena->used < size) {
+        // The next chunks were used by earlier tasks, they are free
+        scratch_chunk_t *next = chunk != NULL ? chunk->next : arena->first;
+        if (next == NULL || next->size < size) {
+            size_t chunk_size = chunk != NULL ? chunk->size * 2 : arena->chunk_size;
+            if (chunk_size < size) {
+                chunk_size = size;
+            }
+            scratch_chunk_t *new_chunk = malloc(sizeof(*new_chunk) + chunk_size);
+            if (new_chunk == NULL) {
+                return NULL;
+            }
+            new_chunk->size = chunk_size;
+            new_chunk->next = next;
+            if (chunk != NULL) {
+                chunk->next = new_chunk;
+            } else {
+                arena->first = new_chunk;
+            }
+            next = new_chunk;
+        }
+        arena->current = next;
+        arena->used = 0;
+        chunk = next;
+    }
+
+    void *memory = chunk->data + arena->used;
+    arena->used += size;
+    return memory;
+}
+
+static void scratch_arena_destroy(scratch_arena_t *arena) {
+    scratch_chunk_t *chunk = arena->first;
+    while (chunk != NULL) {
+        scratch_chunk_t *next = chunk->next;
+        free(chunk);
+        chunk = next;
+    }
+    arena->first = NULL;
+    arena->current = NULL;
+    arena->used = 0;
+}
+
+/// Returns the scratch arena of the calling thread
+static scratch_arena_t *current_scratch_arena(void) {
+    thread_worker_t *worker = current_worker;
+    return worker != NULL ? &worker->scratch : &external_scratch;
+}
+
+static void task_handle_release(thread_pool_task_handle_t *handle) {
+    if (atomic_fetch_sub_explicit(&handle->refs, 1, memory_order_acq_rel) == 1) {
+        free(handle);
+    }
+}
+
+/// Decides whether a task that has a handle or a deadline runs,
+/// it is dropped when it was cancelled or its deadline passed
+static bool pool_claim_task(thread_pool_t *pool, const thread_task_t *task) {
+    bool expired = task->deadline != 0 && get_time_ns() > task->deadline;
+    if (task->handle != NULL) {
+        uint32_t state = THREAD_POOL_TASK_QUEUED;
+        uint32_t next = expired ? THREAD_POOL_TASK_EXPIRED : THREAD_POOL_TASK_STARTED;
+        if (!atomic_compare_exchange_strong_explicit(&task->handle->state, &state, next,
+                                                     memory_order_acq_rel, memory_order_acquire)) {
+            // Counted by thread_pool_cancel_task
+            return false;
+        }
+    }
+    if (expired) {
+        atomic_fetch_add_explicit(&pool->num_expired, 1, memory_order_relaxed);
+        return false;
+    }
+    return true;
+}
+
+/// worker is NULL when the task is run by a thread that is not part of the pool
+static void pool_run_task(thread_pool_t *pool, thread_worker_t *worker, thread_task_t *task) {
+    if ((task->handle != NULL || task->deadline != 0) && !pool_claim_task(pool, task)) {
+        if (task->handle != NULL) {
+            task_handle_release(task->handle);
+        }
+        if (task->group != NULL) {
+            group_task_done(task->group);
+        }
+        if (task->scope != NULL) {
+            task_scope_task_done(task->scope);
+        }
+        pool_task_done(pool);
+        return;
+    }
+
+    uint64_t start = 0;
+    if (pool->stats != NULL || pool->traces != NULL) {
+        start = get_time_ns();
+    }
+    bool track_progress = worker != NULL && pool->monitor_last_started != NULL;
+    if (track_progress) {
+        // Only the worker writes to these
+        uint32_t num_started = atomic_load_explicit(&worker->num_started, memory_order_relaxed);
+        atomic_store_explicit(&worker->num_started, num_started + 1, memory_order_relaxed);
+        if (current_task_depth == 0) {
+            atomic_store_explicit(&worker->busy, true, memory_order_relaxed);
+        }
+    }
+
+    // The scratch memory of the task is released once it returns, the thread
+    // may be a worker of another pool, waiting from one of its tasks
+    scratch_arena_t *scratch = current_scratch_arena();
+    scratch_mark_t scratch_mark = scratch_arena_mark(scratch);
+
+    task_frame_t frame = {
+        .pool = pool,
+        .scope = NULL,
+    };
+    task_frame_t *parent_frame = current_frame;
+    current_frame = &frame;
+    current_task_depth += 1;
+    task->fn(task->has_inline_arg ? task->inline_arg.bytes : task->arg);
+    current_task_depth -= 1;
+    current_frame = parent_frame;
+    if (frame.scope != NULL) {
+        // The tasks it added that are not done yet keep it alive
+        task_scope_release(frame.scope);
+    }
+
+    scratch_arena_rewind(scratch, scratch_mark);
+    if (scratch == &external_scratch && current_task_depth == 0 && scratch->first != NULL) {
+        scratch_arena_destroy(scratch);
+    }
+
+    if (track_progress && current_task_depth == 0) {
+        atomic_store_explicit(&worker->busy, false, memory_order_relaxed);
+    }
+
+    if (task->handle != NULL) {
+        // Before the task is marked as done, for the threads waiting for it
+        atomic_store_explicit(&task->handle->state, THREAD_POOL_TASK_DONE, memory_order_release);
+        task_handle_release(task->handle);
+    }
+
+    uint64_t end = 0;
+    if (pool->stats != NULL || pool->traces != NULL) {
+        end = get_time_ns();
+    }
+    if (pool->traces != NULL) {
+        pool_trace_task(pool, worker, task, start, end);
+    }
+    if (pool->stats != NULL) {
+        // Recorded before the task is marked as done, so that
+        // the stats are up to date once waiters return
+        worker_stats_t *stats = pool_stats_of(pool, worker);
+        stats_add(stats, &stats->tasks_executed, 1);
+        stats_add(stats, &stats->queue_wait_histogram[stats_bucket(start - task->enqueue_time)], 1);
+        stats_add(stats, &stats->run_time_histogram[stats_bucket(end - start)], 1);
+        if (current_task_depth == 0) {
+            // Tasks run while waiting are part of the waiting task's time
+            stats_add(stats, &stats->busy_ns, end - start);
+        }
+    }
+
+    if (task->group != NULL) {
+        group_task_done(task->group);
+    }
+    if (task->scope != NULL) {
+        task_scope_task_done(task->scope);
+    }
+
+    pool_task_done(pool);
+}
+
+/// Returns the index of the node of the CPU the calling thread runs on,
+/// 0 when unknown
+static size_t pool_current_node(thread_pool_t *pool) {
+    int cpu = try_get_current_cpu();
+    if (pool->cpu_nodes == NULL || cpu < 0 || (size_t)cpu >= pool->num_cpu_nodes || pool->cpu_nodes[cpu] < 0) {
+        return 0;
+    }
+    return (size_t)pool->cpu_nodes[cpu];
+}
+
+/// Appends a task to the list of the node, does not notify workers
+static void pool_node_push(thread_pool_t *pool, size_t node_index, const thread_task_t *task) {
+    pool_node_t *node = &pool->nodes[node_index];
+
+    int status = pool_lock(pool);
+    assert(status == 0);
+
+    task_node_t *work = task_cache_alloc(pool, &pool->external_cache);
+    work->task = *task;
+    task_list_push(&node->tasks, work);
+    size_t depth = atomic_fetch_add_explicit(&node->num_tasks, 1, memory_order_relaxed) + 1;
+
+    status = mutex_unlock(&pool->mutex);
+    assert(status == 0);
+    (void)status;
+    pool_record_queue_depth(pool, pool_current_worker(pool), depth);
+}
+
+/// Timeout of pool_ring_push and pool_try_push_task meaning no timeout
+#define POOL_WAIT_FOREVER UINT64_MAX
+
+/// Pushes a task to the ring, waiting up to timeout_ns for room when it is full
+static thread_pool_status_t pool_ring_push(thread_pool_t *pool, const thread_task_t *task, uint64_t timeout_ns) {
+    uint64_t deadline = 0;
+    if (timeout_ns != 0 && timeout_ns != POOL_WAIT_FOREVER) {
+        deadline = get_time_ns() + timeout_ns;
+    }
+
+    while (!mpmc_ring_try_push(&pool->ring, task)) {
+        if (timeout_ns == 0) {
+            return THREAD_POOL_FULL;
+        }
+        uint64_t now = 0;
+        if (deadline != 0) {
+            now = get_time_ns();
+            if (now >= deadline) {
+                return THREAD_POOL_TIMEOUT;
+            }
+        }
+
+        // Workers are the ones making room, the one taking a task wakes us
+        uint32_t epoch = atomic_load_explicit(&pool->ring_space_epoch, memory_order_seq_cst);
+        atomic_fetch_add_explicit(&pool->num_blocked_producers, 1, memory_order_relaxed);
+        atomic_thread_fence(memory_order_seq_cst);
+        bool pushed = mpmc_ring_try_push(&pool->ring, task);
+        if (!pushed) {
+            if (deadline == 0) {
+                futex_wait(&pool->ring_space_epoch, epoch);
+            } else {
+                (void)futex_wait_timeout(&pool->ring_space_epoch, epoch, deadline - now);
+            }
+        }
+        atomic_fetch_sub_explicit(&pool->num_blocked_producers, 1, memory_order_relaxed);
+        if (pushed) {
+            break;
+        }
+    }
+    return THREAD_POOL_OK;
+}
+
+/// Runs a task on the thread adding it, when its scope cannot be created
+/// for lack of memory: it is then done before the adding task may wait for it
+static void pool_run_task_now(thread_pool_t *pool, const thread_task_t *task) {
+    thread_task_t copy = *task;
+    pool_run_task(pool, pool_current_worker(pool), &copy);
+}
+
+/// Makes a copy of the task available to the workers
+///
+/// Only tasks added to the ring by threads outside of the pool can be refused,
+/// timeout_ns telling how long to wait for room (0 not waiting at all)
+static thread_pool_status_t pool_try_push_task(thread_pool_t *pool, const thread_task_t *task, uint64_t timeout_ns) {
+    thread_worker_t *worker = pool_current_worker(pool);
+    atomic_fetch_add_explicit(&pool->pending, 1, memory_order_relaxed);
+
+    thread_task_t stamped;
+    task = pool_stamp_task(pool, task, &stamped);
+    const thread_task_t *scoped = pool_scope_task(pool, task, &stamped);
+    if (scoped == NULL) {
+        pool_run_task_now(pool, task);
+        return THREAD_POOL_OK;
+    }
+    task = scoped;
+
+    if (worker != NULL) {
+        // Tasks spawned by a task stay local, other workers will steal them if idle
+        task_node_t *work = task_cache_alloc(pool, &worker->cache);
+        work->task = *task;
+        if (task_deque_push(&worker->deque, work)) {
+            atomic_fetch_add_explicit(&pool->num_allocations, 1, memory_order_relaxed);
+        }
+        pool_record_queue_depth(pool, worker, task_deque_size(&worker->deque));
+    } else if (pool->ring.cells != NULL) {
+        thread_pool_status_t status = pool_ring_push(pool, task, timeout_ns);
+        if (status != THREAD_POOL_OK) {
+            // Counted as pending, and may have been waited for, in the meantime
+            if (task->scope != NULL) {
+                task_scope_task_done(task->scope);
+            }
+            pool_task_done(pool);
+            return status;
+        }
+        pool_record_queue_depth(pool, NULL, mpmc_ring_size(&pool->ring));
+    } else if (pool->cpu_nodes != NULL) {
+        // Favor the workers close to the submitting thread
+        pool_node_push(pool, pool_current_node(pool), task);
+    } else {
+        int status = pool_lock(pool);
+        assert(status == 0);
+
+        task_node_t *work = task_cache_alloc(pool, &pool->external_cache);
+        work->task = *task;
+        work->next = NULL;
+
+        if (pool->last_task == NULL) {
+            assert(pool->first_task == NULL);
+            pool->first_task = pool->last_task = work;
+        } else {
+            pool->last_task->next = work;
+            pool->last_task = work;
+        }
+        size_t depth = atomic_fetch_add_explicit(&pool->num_injected, 1, memory_order_relaxed) + 1;
+
+        status = mutex_unlock(&pool->mutex);
+        assert(status == 0);
+        (void)status;
+        pool_record_queue_depth(pool, NULL, depth);
+    }
+
+    // Tells a waiting thread that a task arrived
+    pool_notify_tasks_available(pool, 1);
+    return THREAD_POOL_OK;
+}
+
+static void pool_push_task(thread_pool_t *pool, const thread_task_t *task) {
+    thread_pool_status_t status = pool_try_push_task(pool, task, POOL_WAIT_FOREVER);
+    assert(status == THREAD_POOL_OK);
+    (void)status;
+}
+
+/// Same as pool_push_task, in the list of the node
+static void pool_push_node_task(thread_pool_t *pool, size_t node_index, const thread_task_t *task) {
+    atomic_fetch_add_explicit(&pool->pending, 1, memory_order_relaxed);
+
+    thread_task_t stamped;
+    task = pool_stamp_task(pool, task, &stamped);
+    const thread_task_t *scoped = pool_scope_task(pool, task, &stamped);
+    if (scoped == NULL) {
+        pool_run_task_now(pool, task);
+        return;
+    }
+    pool_node_push(pool, node_index, scoped);
+    pool_notify_tasks_available(pool, 1);
+}
+
+/// Same as pool_push_task, in the queue of the priority level
+static void pool_push_prio_task(thread_pool_t *pool, const thread_task_t *task, thread_pool_priority_t priority) {
+    if (priority == THREAD_POOL_PRIORITY_NORMAL) {
+        pool_push_task(pool, task);
+        return;
+    }
+
+    atomic_fetch_add_explicit(&pool->pending, 1, memory_order_relaxed);
+
+    thread_task_t stamped;
+    task = pool_stamp_task(pool, task, &stamped);
+    const thread_task_t *scoped = pool_scope_task(pool, task, &stamped);
+    if (scoped == NULL) {
+        pool_run_task_now(pool, task);
+        return;
+    }
+    task = scoped;
+
+    int status = pool_lock(pool);
+    assert(status == 0);
+
+    task_node_t *work = task_cache_alloc(pool, &pool->external_cache);
+    work->task = *task;
+    task_list_push(&pool->prio_tasks[priority], work);
+    atomic_fetch_or_explicit(&pool->prio_mask, 1u << priority, memory_order_relaxed);
+
+    status = mutex_unlock(&pool->mutex);
+    assert(status == 0);
+    (void)status;
+
+    pool_notify_tasks_available(pool, 1);
+}
+
+/// Argument of the i-th task of a batch
+static void *batch_arg(char *args, size_t i, size_t stride) {
+    // Avoids doing arithmetic on NULL when all tasks get NULL
+    return stride == 0 ? args : args + i * stride;
+}
+
+/// Makes copies of count tasks available to the workers,
+/// task i having the argument args + i * stride
+static void pool_push_tasks(thread_pool_t *pool, const thread_task_t *task, char *args, size_t count, size_t stride) {
+    if (count == 0) {
+        return;
+    }
+
+    thread_worker_t *worker = pool_current_worker(pool);
+    atomic_fetch_add_explicit(&pool->pending, count, memory_order_relaxed);
+
+    thread_task_t current = *task;
+    if (pool_stamps_tasks(pool)) {
+        current.enqueue_time = get_time_ns();
+    }
+    if (current.group == NULL && current_frame != NULL) {
+        if (!pool_current_scope(pool, &current.scope)) {
+            for (size_t i = 0; i < count; ++i) {
+                current.arg = batch_arg(args, i, stride);
+                pool_run_task_now(pool, &current);
+            }
+            return;
+        }
+        if (current.scope != NULL) {
+            task_scope_add(current.scope, count);
+        }
+    }
+    if (worker != NULL) {
+        for (size_t i = 0; i < count; ++i) {
+            task_node_t *work = task_cache_alloc(pool, &worker->cache);
+            work->task = current;
+            work->task.arg = batch_arg(args, i, stride);
+            if (task_deque_push(&worker->deque, work)) {
+                atomic_fetch_add_explicit(&pool->num_allocations, 1, memory_order_relaxed);
+            }
+        }
+        pool_record_queue_depth(pool, worker, task_deque_size(&worker->deque));
+    } else if (pool->ring.cells != NULL) {
+        for (size_t i = 0; i < count; ++i) {
+            current.arg = batch_arg(args, i, stride);
+            if (!mpmc_ring_try_push(&pool->ring, &current)) {
+                // Wake everyone before waiting for room,
+                // the tasks already pushed are what frees it
+                pool_notify_tasks_available(pool, i);
+                thread_pool_status_t status = pool_ring_push(pool, &current, POOL_WAIT_FOREVER);
+                assert(status == THREAD_POOL_OK);
+                (void)status;
+            }
+        }
+        pool_record_queue_depth(pool, NULL, mpmc_ring_size(&pool->ring));
+    } else if (pool->cpu_nodes != NULL) {
+        // Favor the workers close to the submitting thread, as pool_try_push_task does
+        pool_node_t *node = &pool->nodes[pool_current_node(pool)];
+        int status = pool_lock(pool);
+        assert(status == 0);
+
+        for (size_t i = 0; i < count; ++i) {
+            task_node_t *work = task_cache_alloc(pool, &pool->external_cache);
+            work->task = current;
+            work->task.arg = batch_arg(args, i, stride);
+            task_list_push(&node->tasks, work);
+        }
+        size_t depth = atomic_fetch_add_explicit(&node->num_tasks, count, memory_order_relaxed) + count;
+
+        status = mutex_unlock(&pool->mutex);
+        assert(status == 0);
+        (void)status;
+        pool_record_queue_depth(pool, NULL, depth);
+    } else {
+        int status = pool_lock(pool);
+        assert(status == 0);
+
+        task_node_t *first = NULL;
+        task_node_t *last = NULL;
+        for (size_t i = 0; i < count; ++i) {
+            task_node_t *work = task_cache_alloc(pool, &pool->external_cache);
+            work->task = current;
+            work->task.arg = batch_arg(args, i, stride);
+            work->next = NULL;
+            if (last == NULL) {
+                first = work;
+            } else {
+                last->next = work;
+            }
+            last = work;
+        }
+
+        if (pool->last_task == NULL) {
+            assert(pool->first_task == NULL);
+            pool->first_task = first;
+        } else {
+            pool->last_task->next = first;
+        }
+        pool->last_task = last;
+        size_t depth = atomic_fetch_add_explicit(&pool->num_injected, count, memory_order_relaxed) + count;
+
+        status = mutex_unlock(&pool->mutex);
+        assert(status == 0);
+        (void)status;
+        pool_record_queue_depth(pool, NULL, depth);
+    }
+
+    pool_notify_tasks_available(pool, count);
+}
+
+/// What a thread waits for while it runs tasks from within
+/// thread_pool_wait or thread_pool_group_wait
+typedef struct pool_wait_s {
+    thread_pool_t *pool;
+    /// The group waited on, NULL when waiting for the whole pool
+    thread_pool_group_t *group;
+} pool_wait_t;
+
+static bool pool_wait_is_over(const pool_wait_t *wait) {
+    if (wait->group != NULL) {
+        return (atomic_load_explicit(&wait->group->state, memory_order_acquire) & GROUP_PENDING_MASK) == 0;
+    }
+
+    return atomic_load_explicit(&wait->pool->pending, memory_order_seq_cst) == 0;
+}
+
+/// Updates num_surplus after num_active or num_blocked changed, the mutex must be held
+static void pool_update_surplus(thread_pool_t *pool) {
+    size_t needed = pool->base_threads + pool->num_blocked;
+    size_t surplus = pool->num_active > needed ? pool->num_active - needed : 0;
+    atomic_store_explicit(&pool->num_surplus, surplus, memory_order_relaxed);
+}
+
+/// Lets the thread of an idle worker exit, if the pool has more than min_threads
+/// or, for a surplus worker, more than needed since a blocking region ended
+///
+/// \return true if the thread must exit
+static bool pool_retire_worker(thread_worker_t *worker, bool surplus) {
+    thread_pool_t *pool = worker->pool;
+
+    // Pairs with the fence in pool_notify_tasks_available: a wake up
+    // meant for us may have been lost, but then we see the task
+    atomic_thread_fence(memory_order_seq_cst);
+
+    int status = mutex_lock(&pool->mutex);
+    assert(status == 0);
+    size_t keep = surplus ? pool->base_threads + pool->num_blocked : pool->min_threads;
+    bool retire = pool->num_active > keep
+                  && !atomic_load_explicit(&pool->stop_requested, memory_order_relaxed)
+                  && !pool_has_queued_tasks(pool);
+    if (retire) {
+        // The deque is empty, the worker being idle, the slot can be reused as is
+        worker->active = false;
+        pool->num_active -= 1;
+        pool_update_surplus(pool);
+    }
+    status = mutex_unlock(&pool->mutex);
+    assert(status == 0);
+    (void)status;
+    return retire;
+}
+
+/// Blocks the worker until a task may be available, the pool stops
+/// or, when wait is not NULL, the wait is over
+///
+/// Returns false if the worker shall exit
+static bool worker_sleep(thread_worker_t *worker, const pool_wait_t *wait) {
+    thread_pool_t *pool = worker->pool;
+
+    // Do not keep other threads' nodes while sleeping
+    task_free_batch_flush(&worker->free_batch);
+
+    if (wait == NULL && atomic_load_explicit(&pool->num_surplus, memory_order_relaxed) != 0
+        && pool_retire_worker(worker, true)) {
+        return false;
+    }
+
+    // Read before checking for tasks, if a task is pushed after the check
+    // the epoch will have changed and futex_wait returns right away
+    uint32_t epoch = atomic_load_explicit(&pool->wake_epoch, memory_order_seq_cst);
+    atomic_fetch_add_explicit(&pool->num_sleeping, 1, memory_order_relaxed);
+    if (wait != NULL && wait->group != NULL) {
+        // Asks for the last task of the group to wake us
+        atomic_fetch_or_explicit(&wait->group->state, GROUP_HAS_HELPERS, memory_order_relaxed);
+    }
+    atomic_thread_fence(memory_order_seq_cst);
+
+    // A waiting worker keeps sleeping once the pool stops, until the tasks
+    // it waits for are done or there are queued tasks to set aside
+    bool stop = atomic_load_explicit(&pool->stop_requested, memory_order_relaxed);
+    bool timed_out = false;
+    if ((!stop || wait != NULL) && !pool_has_queued_tasks(pool) && (wait == NULL || !pool_wait_is_over(wait))) {
+        if (wait == NULL && pool->min_threads != pool->num_threads) {
+            timed_out = !futex_wait_timeout(&pool->wake_epoch, epoch, pool->idle_timeout_ns);
+        } else {
+            futex_wait(&pool->wake_epoch, epoch);
+        }
+        stop = atomic_load_explicit(&pool->stop_requested, memory_order_relaxed);
+    }
+    atomic_fetch_sub_explicit(&pool->num_sleeping, 1, memory_order_relaxed);
+
+    if (timed_out && !stop && pool_retire_worker(worker, false)) {
+        return false;
+    }
+
+    // Woken up because thread shall stop, it is joined by thread_pool_delete
+    return wait != NULL || !stop;
+}
+
+/// Busy waits a little for tasks before going to sleep,
+/// which is cheaper than sleeping when tasks come in bursts
+///
+/// The duration adapts: it grows when spinning found a task, shrinks otherwise.
+/// Returns true if a task was found
+static bool worker_spin(thread_worker_t *worker, const pool_wait_t *wait, thread_task_t *task) {
+    thread_pool_t *pool = worker->pool;
+
+    // Do not burn more than half of the CPUs
+    size_t max_spinning = pool->num_threads / 2 != 0 ? pool->num_threads / 2 : 1;
+    if (atomic_load_explicit(&pool->num_spinning, memory_order_relaxed) >= max_spinning) {
+        return false;
+    }
+
+    atomic_fetch_add_explicit(&pool->num_spinning, 1, memory_order_seq_cst);
+    bool found = false;
+    for (size_t i = 0; i < worker->spin_limit && !found; ++i) {
+        for (size_t j = 0; j < WORKER_SPIN_RELAX; ++j) {
+            cpu_relax();
+        }
+        if (atomic_load_explicit(&pool->stop_requested, memory_order_relaxed)
+            || (wait != NULL && pool_wait_is_over(wait))) {
+            break;
+        }
+        // Only looking first, actually trying to take a task writes to shared data
+        if (pool_has_queued_tasks(pool)) {
+            found = pool_find_task(pool, worker, &worker->rng_state, task);
+        }
+    }
+    atomic_fetch_sub_explicit(&pool->num_spinning, 1, memory_order_seq_cst);
+
+    if (found) {
+        worker->spin_limit = worker->spin_limit * 2 <= WORKER_SPIN_MAX ? worker->spin_limit * 2 : WORKER_SPIN_MAX;
+    } else {
+        worker->spin_limit = worker->spin_limit / 2 >= WORKER_SPIN_MIN ? worker->spin_limit / 2 : WORKER_SPIN_MIN;
+    }
+    return found;
+}
+
+/// Makes room for capacity abandoned tasks, the mutex must be held
+///
+/// The array is not moved with realloc, since the argument
+/// of inline tasks points into it
+///
+/// \return false when out of memory
+static bool pool_reserve_abandoned(thread_pool_t *pool, size_t capacity) {
+    if (capacity <= pool->abandoned_capacity) {
+        return true;
+    }
+    thread_pool_abandoned_task_t *tasks = malloc(sizeof(*tasks) * capacity);
+    if (tasks == NULL) {
+        return false;
+    }
+    for (size_t i = 0; i < pool->num_abandoned; ++i) {
+        thread_pool_abandoned_task_t *old = &pool->abandoned_tasks[i];
+        tasks[i] = *old;
+        if (old->arg == old->data.bytes) {
+            tasks[i].arg = tasks[i].data.bytes;
+        }
+    }
+    free(pool->abandoned_tasks);
+    pool->abandoned_tasks = tasks;
+    pool->abandoned_capacity = capacity;
+    return true;
+}
+
+/// Sets a task taken out of the queues aside instead of running it,
+/// to be given back by thread_pool_delete_ex
+///
+/// A task that does not fit for lack of memory is run rather than lost
+static void pool_abandon_task(thread_pool_t *pool, thread_task_t *task) {
+    int status = mutex_lock(&pool->mutex);
+    assert(status == 0);
+    if (pool->keep_abandoned && pool->num_abandoned == pool->abandoned_capacity
+        && !pool_reserve_abandoned(pool, pool->abandoned_capacity * 2 + 64)) {
+        status = mutex_unlock(&pool->mutex);
+        assert(status == 0);
+        pool_run_task(pool, pool_current_worker(pool), task);
+        return;
+    }
+
+    bool cancelled = true;
+    if (task->handle != NULL) {
+        uint32_t state = THREAD_POOL_TASK_QUEUED;
+        cancelled = atomic_compare_exchange_strong_explicit(&task->handle->state, &state,
+                                                            THREAD_POOL_TASK_CANCELLED,
+                                                            memory_order_acq_rel, memory_order_acquire);
+        task_handle_release(task->handle);
+    }
+    // A task already cancelled by the caller would not have run anyway
+    if (cancelled && pool->keep_abandoned) {
+        thread_pool_abandoned_task_t *out = &pool->abandoned_tasks[pool->num_abandoned++];
+        out->fn = task->fn;
+        out->arg = task->arg;
+        if (task->has_inline_arg) {
+            memcpy(out->data.bytes, task->inline_arg.bytes, sizeof(out->data.bytes));
+            out->arg = out->data.bytes;
+        }
+    }
+    status = mutex_unlock(&pool->mutex);
+    assert(status == 0);
+    (void)status;
+
+    // The group must not wait forever for a task that will not run
+    if (task->group != NULL) {
+        group_task_done(task->group);
+    }
+    if (task->scope != NULL) {
+        task_scope_task_done(task->scope);
+    }
+}
+
+/// Runs a task found while waiting, unless the pool stops
+/// in which case the task is abandoned like the queued ones
+static void pool_help_run_task(thread_pool_t *pool, thread_worker_t *worker, thread_task_t *task) {
+    if (atomic_load_explicit(&pool->stop_requested, memory_order_relaxed)) {
+        pool_abandon_task(pool, task);
+    } else {
+        pool_run_task(pool, worker, task);
+    }
+}
+
+/// Runs the pool's tasks on the calling thread until the wait is over,
+/// so that tasks waiting on other tasks do not hold a worker idle
+/// (or deadlock the pool when every worker does so)
+static void pool_help_while_waiting(const pool_wait_t *wait) {
+    thread_pool_t *pool = wait->pool;
+    thread_worker_t *worker = pool_current_worker(pool);
+    uint64_t local_rng_state = (uint64_t)(uintptr_t)&local_rng_state | 1;
+    uint64_t *rng_state = worker != NULL ? &worker->rng_state : &local_rng_state;
+
+    bool is_waiting_task = wait->group == NULL && current_task_depth != 0;
+    if (is_waiting_task) {
+        atomic_fetch_add_explicit(&pool->num_waiting_tasks, 1, memory_order_seq_cst);
+    }
+
+    // Once the pool stops, the tasks taken are not run, so that the wait is
+    // over when the tasks it waits for have run or been abandoned
+    while (!pool_wait_is_over(wait)) {
+        thread_task_t task;
+        if (pool_find_task(pool, worker, rng_state, &task)) {
+            pool_help_run_task(pool, worker, &task);
+            continue;
+        }
+
+        if (worker != NULL) {
+            if (worker_spin(worker, wait, &task)) {
+                pool_help_run_task(pool, worker, &task);
+            } else {
+                worker_sleep(worker, wait);
+            }
+            continue;
+        }
+
+        // Threads outside the pool are not needed for tasks to make progress,
+        // they just block until the end
+        if (wait->group != NULL) {
+            group_block(wait->group);
+        } else {
+            int status = mutex_lock(&pool->mutex);
+            assert(status == 0);
+            while (!pool_wait_is_over(wait) && status == 0) {
+                status = condvar_wait(&pool->cond_thread_done, &pool->mutex);
+            }
+            status = mutex_unlock(&pool->mutex);
+            assert(status == 0);
+        }
+        break;
+    }
+
+    if (is_waiting_task) {
+        atomic_fetch_sub_explicit(&pool->num_waiting_tasks, 1, memory_order_seq_cst);
+    }
+}
+
+static void group_wait(thread_pool_group_t *group) {
+    pool_wait_t wait = {
+        .pool = group->pool,
+        .group = group,
+    };
+    pool_help_while_waiting(&wait);
+    group_clear_waiter_bits(group);
+}
+
+/// The function that each thread of the pool will run
+///
+/// The thread runs tasks from its own deque, then from the pool's
+/// injection queue, then steals from other workers.
+/// When there are no tasks anywhere, the thread waits
+main_thread_fn_return_t thread_fn_main(void* arg) {
+    assert(arg != NULL);
+    thread_worker_t *worker = arg;
+    thread_pool_t *pool = worker->pool;
+    current_worker = worker;
+
+    if (worker->num_cpus != 0) {
+        // Placement is only a hint, the worker runs fine anywhere
+        (void)thread_set_affinity(worker->cpus, worker->num_cpus);
+    }
+
+    // When the pool drains its tasks before stopping, there are none left
+    // once stop is requested, otherwise the queued ones are abandoned
+    while (!atomic_load_explicit(&pool->stop_requested, memory_order_relaxed)) {
+        thread_task_t task;
+        if (pool_find_task(pool, worker, &worker->rng_state, &task)) {
+            pool_run_task(pool, worker, &task);
+            continue;
+        }
+
+        uint64_t idle_start = 0;
+        if (worker->stats != NULL) {
+            idle_start = get_time_ns();
+        }
+        bool found = worker_spin(worker, NULL, &task);
+        if (!found && !worker_sleep(worker, NULL)) {
+            break;
+        }
+        if (worker->stats != NULL) {
+            stats_add(worker->stats, &worker->stats->idle_ns, get_time_ns() - idle_start);
+        }
+
+        if (found) {
+            pool_run_task(pool, worker, &task);
+        }
+    }
+
+    current_worker = NULL;
+    return 0;
+}
+
+/// Lists the CPUs the workers may run on, CPUs of a same NUMA node being contiguous
+///
+/// The list is left empty when none of the options need it
+///
+/// \return 0 on success
+static int cpu_topology_init(cpu_topology_t *topology, const thread_pool_options_t *options) {
+    topology->cpus = NULL;
+    topology->nodes = NULL;
+    topology->num_cpus = 0;
+    if (!options->pin_threads && !options->use_process_cpuset && !options->numa_aware) {
+        return 0;
+    }
+
+    int *cpus = malloc(sizeof(int) * MAX_CPUS);
+    int *nodes = malloc(sizeof(int) * MAX_CPUS);
+    if (cpus == NULL || nodes == NULL) {
+        free(cpus);
+        free(nodes);
+        return 1;
+    }
+
+    size_t num_cpus = 0;
+    if (options->use_process_cpuset) {
+        num_cpus = try_get_allowed_cpus(cpus, MAX_CPUS);
+    }
+    if (num_cpus == 0) {
+        long num_online = try_get_num_threads();
+        num_cpus = num_online <= 0 ? 0 : num_online < MAX_CPUS ? (size_t)num_online : MAX_CPUS;
+        for (size_t i = 0; i < num_cpus; ++i) {
+            cpus[i] = (int)i;
+        }
+    }
+
+    for (size_t i = 0; i < num_cpus; ++i) {
+        nodes[i] = options->numa_aware ? try_get_cpu_node(cpus[i]) : -1;
+    }
+    // Insertion sort by node, CPUs of a node stay in increasing order
+    for (size_t i = 1; i < num_cpus; ++i) {
+        int cpu = cpus[i];
+        int node = nodes[i];
+        size_t j = i;
+        while (j > 0 && nodes[j - 1] > node) {
+            cpus[j] = cpus[j - 1];
+            nodes[j] = nodes[j - 1];
+            j -= 1;
+        }
+        cpus[j] = cpu;
+        nodes[j] = node;
+    }
+
+    topology->cpus = cpus;
+    topology->nodes = nodes;
+    topology->num_cpus = num_cpus;
+    return 0;
+}
+
+static void cpu_topology_destroy(cpu_topology_t *topology) {
+    free(topology->cpus);
+    free(topology->nodes);
+}
+
+/// Returns the length of the run of CPUs of the same node starting at first
+static size_t cpu_topology_node_size(const cpu_topology_t *topology, size_t first) {
+    size_t last = first + 1;
+    while (last < topology->num_cpus && topology->nodes[last] == topology->nodes[first]) {
+        last += 1;
+    }
+    return last - first;
+}
+
+/// Spreads the workers evenly over the NUMA nodes, the workers of a node
+/// being contiguous, and chooses the CPUs each of them may run on
+///
+/// \return 0 on success
+static int pool_place_workers(thread_pool_t *pool, const thread_pool_options_t *options) {
+    const cpu_topology_t *topology = &pool->topology;
+
+    size_t num_os_nodes = 1;
+    bool split_nodes = options->numa_aware && topology->num_cpus != 0;
+    if (split_nodes) {
+        num_os_nodes = 0;
+        for (size_t first = 0; first < topology->num_cpus; first += cpu_topology_node_size(topology, first)) {
+            num_os_nodes += 1;
+        }
+    }
+    size_t num_nodes = num_os_nodes < pool->num_threads ? num_os_nodes : pool->num_threads;
+
+    pool->nodes = aligned_malloc(_Alignof(pool_node_t), sizeof(pool_node_t) * num_nodes);
+    if (pool->nodes == NULL) {
+        return 1;
+    }
+    pool->num_nodes = num_nodes;
+
+    if (num_nodes > 1) {
+        int max_cpu = 0;
+        for (size_t i = 0; i < topology->num_cpus; ++i) {
+            max_cpu = topology->cpus[i] > max_cpu ? topology->cpus[i] : max_cpu;
+        }
+        pool->cpu_nodes = malloc(sizeof(int) * ((size_t)max_cpu + 1));
+        if (pool->cpu_nodes == NULL) {
+            return 1;
+        }
+        pool->num_cpu_nodes = (size_t)max_cpu + 1;
+        for (size_t i = 0; i < pool->num_cpu_nodes; ++i) {
+            pool->cpu_nodes[i] = -1;
+        }
+    }
+
+    size_t first_cpu = 0;
+    size_t first_worker = 0;
+    for (size_t n = 0; n < num_nodes; ++n) {
+        size_t node_cpus = split_nodes ? cpu_topology_node_size(topology, first_cpu) : topology->num_cpus;
+
+        pool_node_t *node = &pool->nodes[n];
+        node->tasks.first = NULL;
+        node->tasks.last = NULL;
+        atomic_init(&node->num_tasks, 0);
+        node->os_node = split_nodes ? topology->nodes[first_cpu] : -1;
+        node->first_worker = first_worker;
+        node->num_workers = pool->num_threads / num_nodes + (n < pool->num_threads % num_nodes);
+
+        for (size_t i = 0; i < node_cpus && pool->cpu_nodes != NULL; ++i) {
+            pool->cpu_nodes[topology->cpus[first_cpu + i]] = (int)n;
+        }
+
+        for (size_t i = 0; i < node->num_workers; ++i) {
+            thread_worker_t *worker = &pool->workers[first_worker + i];
+            worker->node = n;
+            worker->cpus = NULL;
+            worker->num_cpus = 0;
+            if (node_cpus == 0) {
+                continue;
+            }
+            if (options->pin_threads) {
+                worker->cpus = &topology->cpus[first_cpu + i % node_cpus];
+                worker->num_cpus = 1;
+            } else if (num_nodes > 1) {
+                worker->cpus = &topology->cpus[first_cpu];
+                worker->num_cpus = node_cpus;
+            }
+        }
+
+        first_cpu += node_cpus;
+        first_worker += node->num_workers;
+    }
+    return 0;
+}
+
+/// Starts a thread for an inactive worker, the pool mutex must be held
+///
+/// \return 0 on success
+static int pool_start_worker(thread_pool_t *pool, thread_worker_t *worker) {
+    assert(!worker->active);
+    worker->active = true;
+    worker->spin_limit = WORKER_SPIN_MIN;
+    atomic_store_explicit(&worker->busy, false, memory_order_relaxed);
+    if (worker->joinable) {
+        // The thread retired, it exits without taking the mutex again
+        int status = thread_join(&worker->thread);
+        assert(status == 0);
+        (void)status;
+        worker->joinable = false;
+    }
+    if (thread_create(&worker->thread, thread_fn_main, worker) != 0) {
+        worker->active = false;
+        return 1;
+    }
+    worker->joinable = true;
+    pool->num_active += 1;
+    pool_update_surplus(pool);
+    return 0;
+}
+
+/// One tick of the monitor, with the pool mutex held
+///
+/// Starts one more worker when tasks wait to be picked up
+/// while no worker is idle and some are stuck in a task since the last tick,
+/// typically blocked on I/O
+static void monitor_tick(thread_pool_t *pool, bool *was_starving) {
+    size_t num_stuck = 0;
+    thread_worker_t *inactive = NULL;
+    for (size_t i = 0; i < pool->num_threads; ++i) {
+        thread_worker_t *worker = &pool->workers[i];
+        uint32_t num_started = atomic_load_explicit(&worker->num_started, memory_order_relaxed);
+        if (!worker->active) {
+            inactive = inactive != NULL ? inactive : worker;
+        } else if (num_started == pool->monitor_last_started[i]
+                   && atomic_load_explicit(&worker->busy, memory_order_relaxed)) {
+            num_stuck += 1;
+        }
+        pool->monitor_last_started[i] = num_started;
+    }
+
+    bool starving = num_stuck != 0
+                    && atomic_load_explicit(&pool->num_sleeping, memory_order_relaxed) == 0
+                    && atomic_load_explicit(&pool->num_spinning, memory_order_relaxed) == 0
+                    && pool_has_queued_tasks(pool);
+    // Tasks must have been waiting for a whole period
+    if (starving && *was_starving && inactive != NULL) {
+        (void)pool_start_worker(pool, inactive);
+        starving = false;
+    }
+    *was_starving = starving;
+}
+
+/// Entry point of the monitor thread of elastic pools
+main_thread_fn_return_t monitor_fn_main(void *arg) {
+    thread_pool_t *pool = arg;
+    bool was_starving = false;
+
+    while (1) {
+        (void)futex_wait_timeout(&pool->monitor_stop, 0, pool->spawn_delay_ns);
+
+        int status = mutex_lock(&pool->mutex);
+        assert(status == 0);
+        if (atomic_load_explicit(&pool->monitor_stop, memory_order_relaxed) != 0) {
+            status = mutex_unlock(&pool->mutex);
+            assert(status == 0);
+            break;
+        }
+        monitor_tick(pool, &was_starving);
+        status = mutex_unlock(&pool->mutex);
+        assert(status == 0);
+        (void)status;
+    }
+    return 0;
+}
+
+static int timer_wheel_init(timer_wheel_t *wheel) {
+    if (mutex_init(&wheel->mutex) != 0) {
+        return 1;
+    }
+    wheel->entries = NULL;
+    wheel->capacity = 0;
+    wheel->free_entries = TIMER_NONE;
+    for (size_t i = 0; i <= TIMER_DUE_BUCKET; ++i) {
+        wheel->buckets[i] = TIMER_NONE;
+    }
+    wheel->num_timers = 0;
+    wheel->now = 0;
+    wheel->start_time = get_time_ns();
+    wheel->wake_tick = 0;
+    atomic_init(&wheel->epoch, 0);
+    wheel->has_thread = false;
+    wheel->stop = false;
+    return 0;
+}
+
+/// Returns the tick of the wheel's clock the time falls in
+static uint64_t timer_wheel_tick(const timer_wheel_t *wheel, uint64_t time) {
+    return (time - wheel->start_time) / TIMER_TICK_NS;
+}
+
+/// Takes an entry from the free list, growing the array when it is empty
+///
+/// \return The index of the entry or TIMER_NONE in case of error
+static uint32_t timer_wheel_alloc(timer_wheel_t *wheel) {
+    if (wheel->free_entries == TIMER_NONE) {
+        uint32_t capacity = wheel->capacity == 0 ? 64 : wheel->capacity * 2;
+        if (capacity <= wheel->capacity || capacity == TIMER_NONE) {
+            return TIMER_NONE;
+        }
+        timer_entry_t *entries = realloc(wheel->entries, sizeof(*entries) * capacity);
+        if (entries == NULL) {
+            return TIMER_NONE;
+        }
+        // Pushed in reverse so that lower indices are used first
+        for (uint32_t i = capacity; i-- > wheel->capacity;) {
+            entries[i].generation = 0;
+            entries[i].bucket = TIMER_NONE;
+            entries[i].next = wheel->free_entries;
+            wheel->free_entries = i;
+        }
+        wheel->entries = entries;
+        wheel->capacity = capacity;
+    }
+
+    uint32_t index = wheel->free_entries;
+    wheel->free_entries = wheel->entries[index].next;
+    wheel->num_timers += 1;
+    return index;
+}
+
+static void timer_wheel_release(timer_wheel_t *wheel, uint32_t index) {
+    timer_entry_t *entry = &wheel->entries[index];
+    entry->generation += 1;
+    entry->bucket = TIMER_NONE;
+    entry->next = wheel->free_entries;
+    wheel->free_entries = index;
+    wheel->num_timers -= 1;
+}
+
+static void timer_wheel_link_bucket(timer_wheel_t *wheel, uint32_t index, uint32_t bucket) {
+    timer_entry_t *entry = &wheel->entries[index];
+    entry->bucket = bucket;
+    entry->prev = TIMER_NONE;
+    entry->next = wheel->buckets[bucket];
+    if (entry->next != TIMER_NONE) {
+        wheel->entries[entry->next].prev = index;
+    }
+    wheel->buckets[bucket] = index;
+}
+
+/// Puts the entry in the slot covering its expiry tick, the level being
+/// the lowest one whose slots do not wrap before the entry is due
+///
+/// Entries due before min_tick go in the slot of min_tick
+static void timer_wheel_link(timer_wheel_t *wheel, uint32_t index, uint64_t min_tick) {
+    uint64_t tick = wheel->entries[index].expires;
+    if (tick < min_tick) {
+        tick = min_tick;
+    }
+    uint64_t delta = tick - wheel->now;
+    size_t level = 0;
+    while (level + 1 < TIMER_LEVELS && delta >= UINT64_C(1) << (TIMER_LEVEL_BITS * (level + 1))) {
+        level += 1;
+    }
+    uint32_t slot = (uint32_t)(tick >> (TIMER_LEVEL_BITS * level)) & (TIMER_SLOTS - 1);
+    timer_wheel_link_bucket(wheel, index, (uint32_t)level * TIMER_SLOTS + slot);
+}
+
+static void timer_wheel_unlink(timer_wheel_t *wheel, uint32_t index) {
+    timer_entry_t *entry = &wheel->entries[index];
+    if (entry->prev != TIMER_NONE) {
+        wheel->entries[entry->prev].next = entry->next;
+    } else {
+        wheel->buckets[entry->bucket] = entry->next;
+    }
+    if (entry->next != TIMER_NONE) {
+        wheel->entries[entry->next].prev = entry->prev;
+    }
+}
+
+/// Moves the wheel one tick forward: the slots of the upper levels that
+/// start at the new tick are spread over the lower levels, then the
+/// entries of the current slot of level 0 are moved to TIMER_DUE_BUCKET
+static void timer_wheel_advance(timer_wheel_t *wheel) {
+    wheel->now += 1;
+    uint64_t now = wheel->now;
+
+    for (size_t level = 1; level < TIMER_LEVELS; ++level) {
+        if ((now & ((UINT64_C(1) << (TIMER_LEVEL_BITS * level)) - 1)) != 0) {
+            break;
+        }
+        uint32_t bucket = (uint32_t)level * TIMER_SLOTS
+                          + ((uint32_t)(now >> (TIMER_LEVEL_BITS * level)) & (TIMER_SLOTS - 1));
+        uint32_t index = wheel->buckets[bucket];
+        wheel->buckets[bucket] = TIMER_NONE;
+        while (index != TIMER_NONE) {
+            uint32_t next = wheel->entries[index].next;
+            timer_wheel_link(wheel, index, now);
+            index = next;
+        }
+    }
+
+    uint32_t bucket = (uint32_t)now & (TIMER_SLOTS - 1);
+    uint32_t index = wheel->buckets[bucket];
+    wheel->buckets[bucket] = TIMER_NONE;
+    while (index != TIMER_NONE) {
+        uint32_t next = wheel->entries[index].next;
+        timer_wheel_link_bucket(wheel, index, TIMER_DUE_BUCKET);
+        index = next;
+    }
+}
+
+/// Returns the next tick at which the wheel has something to do:
+/// a non empty slot of level 0, or else the next cascade of the upper levels
+static uint64_t timer_wheel_next_tick(const timer_wheel_t *wheel) {
+    uint64_t tick = wheel->now + 1;
+    while (wheel->buckets[tick & (TIMER_SLOTS - 1)] == TIMER_NONE
+           && (tick & (TIMER_SLOTS - 1)) != 0) {
+        tick += 1;
+    }
+    return tick;
+}
+
+/// Hands the due tasks to the pool, rescheduling the periodic ones,
+/// with the wheel mutex held (released while pushing)
+static void timer_wheel_fire(thread_pool_t *pool) {
+    timer_wheel_t *wheel = &pool->timers;
+    thread_task_t tasks[TIMER_BATCH_SIZE];
+
+    while (!wheel->stop && wheel->buckets[TIMER_DUE_BUCKET] != TIMER_NONE) {
+        size_t count = 0;
+        while (count < TIMER_BATCH_SIZE && wheel->buckets[TIMER_DUE_BUCKET] != TIMER_NONE) {
+            uint32_t index = wheel->buckets[TIMER_DUE_BUCKET];
+            timer_entry_t *entry = &wheel->entries[index];
+            timer_wheel_unlink(wheel, index);
+            tasks[count++] = task_init(entry->fn, entry->arg);
+
+            if (entry->period != 0) {
+                entry->expires += entry->period;
+                if (entry->expires <= wheel->now) {
+                    // Runs that were missed (the timer thread being late) are skipped
+                    entry->expires = wheel->now + entry->period;
+                }
+                timer_wheel_link(wheel, index, wheel->now + 1);
+            } else {
+                timer_wheel_release(wheel, index);
+            }
+        }
+
+        // Entries still due can be cancelled meanwhile, they stay in their bucket
+        int status = mutex_unlock(&wheel->mutex);
+        assert(status == 0);
+        for (size_t i = 0; i < count; ++i) {
+            pool_push_task(pool, &tasks[i]);
+        }
+        status = mutex_lock(&wheel->mutex);
+        assert(status == 0);
+        (void)status;
+    }
+}
+
+/// Entry point of the timer thread, moving the wheel forward
+/// and sleeping until the next tick with something to do
+main_thread_fn_return_t timer_fn_main(void *arg) {
+    thread_pool_t *pool = arg;
+    timer_wheel_t *wheel = &pool->timers;
+
+    int status = mutex_lock(&wheel->mutex);
+    assert(status == 0);
+    while (!wheel->stop) {
+        uint64_t current = timer_wheel_tick(wheel, get_time_ns());
+        while (wheel->now < current && wheel->num_timers != 0) {
+            timer_wheel_advance(wheel);
+            timer_wheel_fire(pool);
+            if (wheel->stop) {
+                break;
+            }
+        }
+        if (wheel->stop) {
+            break;
+        }
+        if (wheel->num_timers == 0) {
+            // Nothing to move, the next timer will be placed relative to the current tick
+            wheel->now = current;
+        }
+
+        uint32_t epoch = atomic_load_explicit(&wheel->epoch, memory_order_relaxed);
+        uint64_t timeout_ns = POOL_WAIT_FOREVER;
+        if (wheel->num_timers != 0) {
+            wheel->wake_tick = timer_wheel_next_tick(wheel);
+            uint64_t wake_time = wheel->start_time + wheel->wake_tick * TIMER_TICK_NS;
+            uint64_t now = get_time_ns();
+            timeout_ns = wake_time > now ? wake_time - now : 0;
+        } else {
+            wheel->wake_tick = UINT64_MAX;
+        }
+        status = mutex_unlock(&wheel->mutex);
+        assert(status == 0);
+
+        if (timeout_ns == POOL_WAIT_FOREVER) {
+            futex_wait(&wheel->epoch, epoch);
+        } else if (timeout_ns != 0) {
+            (void)futex_wait_timeout(&wheel->epoch, epoch, timeout_ns);
+        }
+
+        status = mutex_lock(&wheel->mutex);
+        assert(status == 0);
+    }
+    status = mutex_unlock(&wheel->mutex);
+    assert(status == 0);
+    (void)status;
+    return 0;
+}
+
+/// Schedules fn(arg) after delay_ns, then every period_ns when not zero
+static thread_pool_timer_t pool_add_timer(thread_pool_t *pool, uint64_t delay_ns, uint64_t period_ns,
+                                          thread_task_fn_t *fn, void *arg) {
+    timer_wheel_t *wheel = &pool->timers;
+    uint64_t now = get_time_ns();
+
+    int status = mutex_lock(&wheel->mutex);
+    assert(status == 0);
+
+    if (wheel->stop) {
+        status = mutex_unlock(&wheel->mutex);
+        assert(status == 0);
+        return 0;
+    }
+    if (!wheel->has_thread) {
+        wheel->has_thread = thread_create(&wheel->thread, timer_fn_main, pool) == 0;
+    }
+
+    uint32_t index = TIMER_NONE;
+    if (wheel->has_thread) {
+        index = timer_wheel_alloc(wheel);
+    }
+    if (index == TIMER_NONE) {
+        status = mutex_unlock(&wheel->mutex);
+        assert(status == 0);
+        return 0;
+    }
+    if (wheel->num_timers == 1) {
+        // The wheel was empty, so it may not have moved for a while
+        wheel->now = timer_wheel_tick(wheel, now);
+    }
+
+    // Rounded up so that the task never runs early
+    uint64_t delay = (now - wheel->start_time) % TIMER_TICK_NS + delay_ns;
+    uint64_t delay_ticks = delay / TIMER_TICK_NS + (delay % TIMER_TICK_NS != 0);
+    uint64_t expires = timer_wheel_tick(wheel, now) + delay_ticks;
+    if (expires - wheel->now > TIMER_MAX_TICKS) {
+        expires = wheel->now + TIMER_MAX_TICKS;
+    }
+    uint64_t period = period_ns / TIMER_TICK_NS + (period_ns % TIMER_TICK_NS != 0);
+
+    timer_entry_t *entry = &wheel->entries[index];
+    entry->fn = fn;
+    entry->arg = arg;
+    entry->expires = expires;
+    entry->period = period > TIMER_MAX_TICKS ? TIMER_MAX_TICKS : period;
+    timer_wheel_link(wheel, index, wheel->now + 1);
+
+    if (expires < wheel->wake_tick) {
+        atomic_fetch_add_explicit(&wheel->epoch, 1, memory_order_relaxed);
+        futex_wake_one(&wheel->epoch);
+    }
+    thread_pool_timer_t timer = ((uint64_t)entry->generation << 32) | ((uint64_t)index + 1);
+
+    status = mutex_unlock(&wheel->mutex);
+    assert(status == 0);
+    (void)status;
+    return timer;
+}
+
+/// Stops the timer thread, dropping the timers that did not fire yet
+static void pool_stop_timers(thread_pool_t *pool) {
+    timer_wheel_t *wheel = &pool->timers;
+    int status = mutex_lock(&wheel->mutex);
+    assert(status == 0);
+    wheel->stop = true;
+    atomic_fetch_add_explicit(&wheel->epoch, 1, memory_order_relaxed);
+    futex_wake_all(&wheel->epoch);
+    // No thread is started once stop is set
+    bool has_thread = wheel->has_thread;
+    status = mutex_unlock(&wheel->mutex);
+    assert(status == 0);
+    (void)status;
+
+    // The tasks it may still be pushing must be counted before waiting for them
+    if (has_thread) {
+        status = thread_join(&wheel->thread);
+        assert(status == 0);
+    }
+}
+
+static void pool_free(thread_pool_t *pool, size_t num_deques) {
+    for (size_t i = 0; i < num_deques; ++i) {
+        thread_worker_t *worker = &pool->workers[i];
+        task_deque_destroy(&worker->deque);
+        task_cache_destroy(&worker->cache);
+        scratch_arena_destroy(&worker->scratch);
+    }
+    aligned_free(pool->workers);
+    aligned_free(pool->nodes);
+    aligned_free(pool->stats);
+    if (pool->traces != NULL) {
+        for (size_t i = 0; i <= pool->num_threads; ++i) {
+            free(pool->traces[i].events);
+        }
+    }
+    aligned_free(pool->traces);
+    free(pool->monitor_last_started);
+    free(pool->timers.entries);
+    free(pool->cpu_nodes);
+    cpu_topology_destroy(&pool->topology);
+
+    task_cache_destroy(&pool->external_cache);
+    mpmc_ring_destroy(&pool->ring);
+    free(pool->abandoned_tasks);
+    aligned_free(pool);
+}
+
+/// Allocates a ring of (at least) num_events events per worker, plus one for
+/// the threads that are not part of the pool, pool->num_threads must be set
+///
+/// \return 0 on success
+static int pool_init_traces(thread_pool_t *pool, size_t num_events) {
+    size_t capacity = 1;
+    while (capacity < num_events) {
+        capacity *= 2;
+    }
+
+    size_t num_rings = pool->num_threads + 1;
+    pool->traces = aligned_malloc(_Alignof(trace_ring_t), sizeof(trace_ring_t) * num_rings);
+    if (pool->traces == NULL) {
+        return 1;
+    }
+    for (size_t i = 0; i < num_rings; ++i) {
+        pool->traces[i].events = NULL;
+    }
+    for (size_t i = 0; i < num_rings; ++i) {
+        trace_ring_t *ring = &pool->traces[i];
+        ring->events = malloc(sizeof(trace_event_t) * capacity);
+        if (ring->events == NULL) {
+            return 1;
+        }
+        for (size_t j = 0; j < capacity; ++j) {
+            atomic_init(&ring->events[j].sequence, 0);
+        }
+        ring->mask = capacity - 1;
+        atomic_init(&ring->head, 0);
+        ring->exclusive = i < pool->num_threads;
+    }
+    return 0;
+}
+
+void thread_pool_options_init(thread_pool_options_t *options) {
+    assert(options != NULL);
+    options->num_threads = 0;
+    options->queue_capacity = 0;
+    options->pin_threads = false;
+    options->use_process_cpuset = false;
+    options->numa_aware = false;
+    options->collect_stats = false;
+    options->trace_events = 0;
+    options->scratch_size = SCRATCH_DEFAULT_SIZE;
+    options->min_threads = 0;
+    options->max_threads = 0;
+    options->idle_timeout_ms = 10000;
+    options->spawn_delay_ms = 100;
+}
+
+thread_pool_t * thread_pool_create(size_t num_threads) {
+    thread_pool_options_t options;
+    thread_pool_options_init(&options);
+    options.num_threads = num_threads;
+    return thread_pool_create_ex(&options);
+}
+
+thread_pool_t * thread_pool_create_ex(const thread_pool_options_t *options) {
+    assert(options != NULL);
+
+    cpu_topology_t topology;
+    if (cpu_topology_init(&topology, options) != 0) {
+        return NULL;
+    }
+
+    size_t num_threads = options->num_threads;
+    if (num_threads == 0) {
+        if (options->use_process_cpuset && topology.num_cpus != 0) {
+            num_threads = topology.num_cpus;
+        } else {
+            num_threads = try_get_num_threads();
+        }
+    }
+
+    // assert msg: Cannot determine number of threads in this platform
+    // please provide a number
+    assert(num_threads != 0);
+
+    // Workers are allocated for max_threads, only num_threads of them start
+    size_t initial_threads = num_threads;
+    size_t min_threads = options->min_threads != 0 && options->min_threads < num_threads
+                         ? options->min_threads : num_threads;
+    if (options->max_threads > num_threads) {
+        num_threads = options->max_threads;
+    }
+
+    thread_pool_t *pool = aligned_malloc(_Alignof(thread_pool_t), sizeof(*pool));
+
+    if (pool == NULL) {
+        cpu_topology_destroy(&topology);
+        return NULL;
+    }
+    pool->topology = topology;
+    pool->nodes = NULL;
+    pool->num_nodes = 0;
+    pool->cpu_nodes = NULL;
+    pool->num_cpu_nodes = 0;
+    pool->ring.cells = NULL;
+    pool->stats = NULL;
+    pool->traces = NULL;
+    pool->trace_start = get_time_ns();
+    pool->monitor_last_started = NULL;
+    pool->timers.entries = NULL;
+    pool->abandoned_tasks = NULL;
+    pool->num_abandoned = 0;
+    pool->abandoned_capacity = 0;
+    pool->keep_abandoned = false;
+    task_cache_init(&pool->external_cache);
+
+    pool->workers = aligned_malloc(_Alignof(thread_worker_t), sizeof(thread_worker_t) * num_threads);
+    if (pool->workers == NULL) {
+        pool_free(pool, 0);
+        return NULL;
+    }
+    if (options->queue_capacity != 0 && mpmc_ring_init(&pool->ring, options->queue_capacity, sizeof(thread_task_t)) != 0) {
+        pool_free(pool, 0);
+        return NULL;
+    }
+    pool->num_threads = num_threads;
+    pool->min_threads = min_threads;
+    pool->num_active = 0;
+    pool->base_threads = initial_threads;
+    pool->num_blocked = 0;
+    atomic_init(&pool->num_surplus, 0);
+    pool->idle_timeout_ns = (uint64_t)options->idle_timeout_ms * 1000000u;
+    pool->spawn_delay_ns = (uint64_t)options->spawn_delay_ms * 1000000u;
+    atomic_init(&pool->monitor_stop, 0);
+    if (initial_threads != num_threads) {
+        pool->monitor_last_started = calloc(num_threads, sizeof(uint32_t));
+        if (pool->monitor_last_started == NULL) {
+            pool_free(pool, 0);
+            return NULL;
+        }
+    }
+    if (pool_place_workers(pool, options) != 0) {
+        pool_free(pool, 0);
+        return NULL;
+    }
+    if (options->collect_stats) {
+        pool->stats = aligned_malloc(_Alignof(worker_stats_t), sizeof(worker_stats_t) * (num_threads + 1));
+        if (pool->stats == NULL) {
+            pool_free(pool, 0);
+            return NULL;
+        }
+        for (size_t i = 0; i <= num_threads; ++i) {
+            worker_stats_t *stats = &pool->stats[i];
+            atomic_init(&stats->tasks_executed, 0);
+            atomic_init(&stats->tasks_stolen, 0);
+            atomic_init(&stats->busy_ns, 0);
+            atomic_init(&stats->idle_ns, 0);
+            atomic_init(&stats->lock_wait_ns, 0);
+            atomic_init(&stats->max_queue_depth, 0);
+            for (size_t j = 0; j < THREAD_POOL_STATS_BUCKETS; ++j) {
+                atomic_init(&stats->queue_wait_histogram[j], 0);
+                atomic_init(&stats->run_time_histogram[j], 0);
+            }
+            stats->exclusive = i < num_threads;
+        }
+    }
+    if (options->trace_events != 0 && pool_init_traces(pool, options->trace_events) != 0) {
+        pool_free(pool, 0);
+        return NULL;
+    }
+    atomic_init(&pool->stop_requested, false);
+    pool->first_task = NULL;
+    pool->last_task = NULL;
+    atomic_init(&pool->num_injected, 0);
+    atomic_init(&pool->ring_space_epoch, 0);
+    atomic_init(&pool->num_blocked_producers, 0);
+    for (size_t i = 0; i < THREAD_POOL_NUM_PRIORITIES; ++i) {
+        pool->prio_tasks[i].first = NULL;
+        pool->prio_tasks[i].last = NULL;
+    }
+    atomic_init(&pool->prio_mask, 0);
+    atomic_init(&pool->low_prio_skips, 0);
+    atomic_init(&pool->num_allocations, 0);
+    atomic_init(&pool->num_cancelled, 0);
+    atomic_init(&pool->num_expired, 0);
+    atomic_init(&pool->pending, 0);
+    atomic_init(&pool->num_waiting_tasks, 0);
+    atomic_init(&pool->wake_epoch, 0);
+    atomic_init(&pool->num_sleeping, 0);
+    atomic_init(&pool->num_spinning, 0);
+    atomic_init(&pool->num_searching, 0);
+
+    for (size_t i = 0; i < num_threads; ++i) {
+        thread_worker_t *worker = &pool->workers[i];
+        if (task_deque_init(&worker->deque) != 0) {
+            pool_free(pool, i);
+            return NULL;
+        }
+        worker->pool = pool;
+        worker->index = i;
+        // Any non-zero seed works for xorshift
+        worker->rng_state = 0x9E3779B97F4A7C15ull * (i + 1);
+        worker->spin_limit = WORKER_SPIN_MIN;
+        worker->stats = pool->stats != NULL ? &pool->stats[i] : NULL;
+        worker->active = false;
+        worker->joinable = false;
+        atomic_init(&worker->num_started, 0);
+        atomic_init(&worker->busy, false);
+        worker->blocking_depth = 0;
+        task_cache_init(&worker->cache);
+        worker->free_batch.owner = NULL;
+        worker->free_batch.first = NULL;
+        worker->free_batch.last = NULL;
+        worker->free_batch.count = 0;
+        worker->scratch.first = NULL;
+        worker->scratch.current = NULL;
+        worker->scratch.used = 0;
+        worker->scratch.chunk_size = options->scratch_size != 0 ? options->scratch_size : SCRATCH_DEFAULT_SIZE;
+    }
+
+    if (mutex_init(&pool->mutex) != 0) {
+        pool_free(pool, num_threads);
+        return NULL;
+    }
+
+    if (condvar_init(&pool->cond_thread_done) != 0) {
+        pool_free(pool, num_threads);
+        return NULL;
+    }
+
+    if (timer_wheel_init(&pool->timers) != 0) {
+        pool_free(pool, num_threads);
+        return NULL;
+    }
+
+    // Lock ourselves while we are creating threads
+    if (mutex_lock(&pool->mutex) != 0) {
+        pool_free(pool, num_threads);
+        return NULL;
+    }
+
+    for (size_t i = 0; i < initial_threads; i++) {
+        int status = pool_start_worker(pool, &pool->workers[i]);
+        assert(status == 0);
+        (void)status;
+    }
+    if (pool->monitor_last_started != NULL) {
+        int status = thread_create(&pool->monitor, monitor_fn_main, pool);
+        assert(status == 0);
+        (void)status;
+    }
+    int status = mutex_unlock(&pool->mutex);
+    assert(status == 0);
+    (void)status;
+
+    return pool;
+}
+
+void thread_pool_wait(thread_pool_t *pool) {
+    assert(pool != NULL);
+
+    task_frame_t *frame = current_frame;
+    if (frame != NULL && frame->pool == pool) {
+        // The calling task, and the others waiting like it, cannot finish before
+        // their wait does, so only the tasks it added are waited for
+        if (frame->scope != NULL) {
+            group_wait(&frame->scope->group);
+        }
+        return;
+    }
+
+    pool_wait_t wait = {
+        .pool = pool,
+        .group = NULL,
+    };
+    pool_help_while_waiting(&wait);
+}
+
+void thread_pool_add_task(thread_pool_t *pool, thread_task_fn_t *fn, void* arg)
+{
+    assert(pool != NULL);
+
+    thread_task_t task = task_init(fn, arg);
+    pool_push_task(pool, &task);
+}
+
+thread_pool_status_t thread_pool_try_add_task(thread_pool_t *pool, thread_task_fn_t *fn, void *arg)
+{
+    assert(pool != NULL);
+
+    thread_task_t task = task_init(fn, arg);
+    return pool_try_push_task(pool, &task, 0);
+}
+
+thread_pool_status_t thread_pool_add_task_timeout(thread_pool_t *pool, thread_task_fn_t *fn, void *arg,
+                                                  unsigned timeout_ms)
+{
+    assert(pool != NULL);
+
+    thread_task_t task = task_init(fn, arg);
+    return pool_try_push_task(pool, &task, (uint64_t)timeout_ms * 1000000u);
+}
+
+void thread_pool_add_task_labeled(thread_pool_t *pool, thread_task_fn_t *fn, void *arg, const char *label)
+{
+    assert(pool != NULL);
+
+    thread_task_t task = task_init(fn, arg);
+    task.label = label;
+    pool_push_task(pool, &task);
+}
+
+void thread_pool_add_task_deadline(thread_pool_t *pool, thread_task_fn_t *fn, void *arg, uint64_t timeout_ns)
+{
+    assert(pool != NULL);
+
+    thread_task_t task = task_init(fn, arg);
+    // A deadline of 0 would mean none
+    task.deadline = get_time_ns() + timeout_ns + 1;
+    pool_push_task(pool, &task);
+}
+
+thread_pool_task_handle_t * thread_pool_add_cancellable_task(thread_pool_t *pool, thread_task_fn_t *fn, void *arg,
+                                                             uint64_t timeout_ns)
+{
+    assert(pool != NULL);
+
+    thread_pool_task_handle_t *handle = malloc(sizeof(*handle));
+    if (handle == NULL) {
+        return NULL;
+    }
+    handle->pool = pool;
+    atomic_init(&handle->state, THREAD_POOL_TASK_QUEUED);
+    atomic_init(&handle->refs, 2);
+
+    thread_task_t task = task_init(fn, arg);
+    task.handle = handle;
+    task.deadline = timeout_ns != 0 ? get_time_ns() + timeout_ns + 1 : 0;
+    pool_push_task(pool, &task);
+    return handle;
+}
+
+bool thread_pool_cancel_task(thread_pool_task_handle_t *handle)
+{
+    assert(handle != NULL);
+
+    uint32_t state = THREAD_POOL_TASK_QUEUED;
+    if (!atomic_compare_exchange_strong_explicit(&handle->state, &state, THREAD_POOL_TASK_CANCELLED,
+                                                 memory_order_acq_rel, memory_order_acquire)) {
+        return false;
+    }
+    atomic_fetch_add_explicit(&handle->pool->num_cancelled, 1, memory_order_relaxed);
+    return true;
+}
+
+thread_pool_task_state_t thread_pool_task_state(const thread_pool_task_handle_t *handle)
+{
+    assert(handle != NULL);
+    return (thread_pool_task_state_t)atomic_load_explicit(&handle->state, memory_order_acquire);
+}
+
+void thread_pool_task_handle_release(thread_pool_task_handle_t *handle)
+{
+    if (handle == NULL) {
+        return;
+    }
+    task_handle_release(handle);
+}
+
+void thread_pool_add_task_prio(thread_pool_t *pool, thread_task_fn_t *fn, void *arg, thread_pool_priority_t priority)
+{
+    assert(pool != NULL);
+    assert(priority >= THREAD_POOL_PRIORITY_HIGH && priority < THREAD_POOL_NUM_PRIORITIES);
+
+    thread_task_t task = task_init(fn, arg);
+    pool_push_prio_task(pool, &task, priority);
+}
+
+void thread_pool_add_task_on_node(thread_pool_t *pool, thread_task_fn_t *fn, void *arg, int node)
+{
+    assert(pool != NULL);
+
+    thread_task_t task = task_init(fn, arg);
+    // The node lists are not bounded, threads outside of the pool go through
+    // the ring like for thread_pool_add_task when the pool has a capacity
+    bool bounded = pool->ring.cells != NULL && pool_current_worker(pool) == NULL;
+    for (size_t i = 0; i < pool->num_nodes && !bounded; ++i) {
+        if (pool->nodes[i].os_node == node && pool->num_nodes > 1) {
+            pool_push_node_task(pool, i, &task);
+            return;
+        }
+    }
+    pool_push_task(pool, &task);
+}
+
+thread_pool_timer_t thread_pool_add_task_after(thread_pool_t *pool, uint64_t delay_ns, thread_task_fn_t *fn, void *arg)
+{
+    assert(pool != NULL);
+    assert(fn != NULL);
+    return pool_add_timer(pool, delay_ns, 0, fn, arg);
+}
+
+thread_pool_timer_t thread_pool_add_periodic_task(thread_pool_t *pool, uint64_t delay_ns, uint64_t period_ns,
+                                                  thread_task_fn_t *fn, void *arg)
+{
+    assert(pool != NULL);
+    assert(fn != NULL);
+    assert(period_ns != 0);
+    return pool_add_timer(pool, delay_ns, period_ns, fn, arg);
+}
+
+bool thread_pool_cancel_timer(thread_pool_t *pool, thread_pool_timer_t timer)
+{
+    assert(pool != NULL);
+    if (timer == 0) {
+        return false;
+    }
+
+    timer_wheel_t *wheel = &pool->timers;
+    uint32_t index = (uint32_t)(timer & 0xFFFFFFFFu) - 1;
+    uint32_t generation = (uint32_t)(timer >> 32);
+
+    int status = mutex_lock(&wheel->mutex);
+    assert(status == 0);
+    bool cancelled = index < wheel->capacity
+                     && wheel->entries[index].generation == generation
+                     && wheel->entries[index].bucket != TIMER_NONE;
+    if (cancelled) {
+        timer_wheel_unlink(wheel, index);
+        timer_wheel_release(wheel, index);
+    }
+    status = mutex_unlock(&wheel->mutex);
+    assert(status == 0);
+    (void)status;
+    return cancelled;
+}
+
+void thread_pool_add_task_inline(thread_pool_t *pool, thread_task_fn_t *fn, const void *data, size_t len)
+{
+    assert(pool != NULL);
+    assert(len <= TASK_INLINE_ARG_SIZE);
+    assert(data != NULL || len == 0);
+
+    thread_task_t task = task_init(fn, NULL);
+    task.has_inline_arg = true;
+    if (len != 0) {
+        memcpy(task.inline_arg.bytes, data, len);
+    }
+    pool_push_task(pool, &task);
+}
+
+void thread_pool_add_tasks(thread_pool_t *pool, thread_task_fn_t *fn, void *args, size_t count, size_t stride)
+{
+    assert(pool != NULL);
+
+    thread_task_t task = task_init(fn, NULL);
+    pool_push_tasks(pool, &task, args, count, stride);
+}
+
+/// Shared state of a parallel for
+typedef struct parallel_for_s {
+    thread_pool_t *pool;
+    thread_pool_range_fn_t *body;
+    void *ctx;
+    size_t grain;
+    /// Sub ranges not finished yet
+    thread_pool_group_t group;
+    /// Number of sub ranges pushed to the pool and not picked up yet
+    _Atomic size_t num_queued;
+} parallel_for_t;
+
+/// Inline argument of the tasks of a parallel for
+typedef struct parallel_for_range_s {
+    parallel_for_t *pf;
+    size_t begin;
+    size_t end;
+} parallel_for_range_t;
+
+static_assert(sizeof(parallel_for_range_t) <= TASK_INLINE_ARG_SIZE, "parallel_for_range_t must fit in a task");
+
+static void parallel_for_run(parallel_for_t *pf, size_t begin, size_t end);
+
+static void parallel_for_task(void *arg) {
+    parallel_for_range_t *range = arg;
+    atomic_fetch_sub_explicit(&range->pf->num_queued, 1, memory_order_relaxed);
+    parallel_for_run(range->pf, range->begin, range->end);
+}
+
+static void parallel_for_push(parallel_for_t *pf, size_t begin, size_t end) {
+    thread_task_t task = task_init(parallel_for_task, NULL);
+    task.group = &pf->group;
+    task.has_inline_arg = true;
+    parallel_for_range_t range = {
+        .pf = pf,
+        .begin = begin,
+        .end = end,
+    };
+    memcpy(task.inline_arg.bytes, &range, sizeof(range));
+
+    atomic_fetch_add_explicit(&pf->num_queued, 1, memory_order_relaxed);
+    group_add(&pf->group, 1);
+    pool_push_task(pf->pool, &task);
+}
+
+/// A range is split only when some worker is looking for work
+/// and no part of the loop is already waiting to be picked up
+static bool parallel_for_should_split(parallel_for_t *pf) {
+    if (atomic_load_explicit(&pf->num_queued, memory_order_relaxed) != 0) {
+        return false;
+    }
+    return atomic_load_explicit(&pf->pool->num_searching, memory_order_relaxed) != 0
+           || atomic_load_explicit(&pf->pool->num_sleeping, memory_order_relaxed) != 0;
+}
+
+/// Returns the end of the first num_grains grains of [begin, end)
+static size_t parallel_for_grains_end(size_t begin, size_t end, size_t grain, size_t num_grains) {
+    return num_grains >= (end - begin) / grain ? end : begin + num_grains * grain;
+}
+
+/// Runs the range grain by grain, giving away its upper half
+/// whenever another worker could take it
+///
+/// Ranges start on a whole number of grains from the beginning of the loop,
+/// so only the last chunk of the loop can be smaller than a grain
+static void parallel_for_run(parallel_for_t *pf, size_t begin, size_t end) {
+    while (begin < end) {
+        if (end - begin >= 2 * pf->grain && parallel_for_should_split(pf)) {
+            size_t middle = begin + (end - begin) / pf->grain / 2 * pf->grain;
+            parallel_for_push(pf, middle, end);
+            end = middle;
+            continue;
+        }
+
+        size_t chunk_end = end - begin > pf->grain ? begin + pf->grain : end;
+        pf->body(pf->ctx, begin, chunk_end);
+        begin = chunk_end;
+    }
+}
+
+void thread_pool_parallel_for(thread_pool_t *pool, size_t begin, size_t end, size_t grain,
+                              thread_pool_range_fn_t *body, void *ctx)
+{
+    assert(pool != NULL);
+    assert(body != NULL);
+
+    if (begin >= end) {
+        return;
+    }
+    if (grain == 0) {
+        grain = 1;
+    }
+
+    size_t count = end - begin;
+    parallel_for_t pf = {
+        .pool = pool,
+        .body = body,
+        .ctx = ctx,
+        .grain = grain,
+    };
+    group_init(&pf.group, pool);
+    atomic_init(&pf.num_queued, 0);
+
+    // Start with one piece per worker having a thread (if there are enough
+    // grains), pieces are split further only if some worker runs out of work
+    size_t num_pieces = pool->min_threads == pool->num_threads ? pool->num_threads
+                                                               : thread_pool_num_active_threads(pool);
+    if (num_pieces > count / grain) {
+        num_pieces = count / grain;
+    }
+    if (num_pieces == 0) {
+        num_pieces = 1;
+    }
+
+    // Pieces are made of whole grains, the last one ending with the short one if any
+    size_t num_grains = count / grain + (count % grain != 0);
+    size_t piece_grains = num_grains / num_pieces;
+    size_t first_end = parallel_for_grains_end(begin, end, grain, piece_grains + num_grains % num_pieces);
+    for (size_t piece_begin = first_end; piece_begin < end;) {
+        size_t piece_end = parallel_for_grains_end(piece_begin, end, grain, piece_grains);
+        parallel_for_push(&pf, piece_begin, piece_end);
+        piece_begin = piece_end;
+    }
+
+    // The calling thread does its share instead of just waiting
+    parallel_for_run(&pf, begin, first_end);
+
+    group_wait(&pf.group);
+}
+
+/// Shared state of a parallel reduce
+typedef struct parallel_reduce_s {
+    thread_pool_t *pool;
+    thread_pool_reduce_fn_t *reduce;
+    thread_pool_combine_fn_t *combine;
+    void *ctx;
+    const void *identity;
+    size_t size;
+    /// One partial result per worker, plus a last one for the threads that are
+    /// not workers of the pool, each on its own cache lines
+    unsigned char *partials;
+    size_t stride;
+    /// Protects the last partial result
+    atomic_flag external_lock;
+} parallel_reduce_t;
+
+/// Size up to which sub ranges are accumulated on the stack
+#define REDUCE_STACK_PARTIAL_SIZE 256
+
+static void parallel_reduce_body(void *arg, size_t begin, size_t end) {
+    parallel_reduce_t *pr = arg;
+    thread_worker_t *worker = pool_current_worker(pr->pool);
+
+    // The sub range is accumulated apart, then combined into the partial
+    // result of the thread: if reduce waits, the thread may run another
+    // sub range in the meantime, which combines into it too
+    _Alignas(max_align_t) unsigned char buffer[REDUCE_STACK_PARTIAL_SIZE];
+    void *partial = pr->size <= sizeof(buffer) ? buffer : malloc(pr->size);
+    if (partial != NULL) {
+        memcpy(partial, pr->identity, pr->size);
+        pr->reduce(pr->ctx, begin, end, partial);
+    }
+
+    if (worker != NULL) {
+        void *own = pr->partials + worker->index * pr->stride;
+        if (partial != NULL) {
+            pr->combine(pr->ctx, own, partial);
+        } else {
+            pr->reduce(pr->ctx, begin, end, own);
+        }
+    } else {
+        // The shared partial result is only locked to combine into it
+        while (atomic_flag_test_and_set_explicit(&pr->external_lock, memory_order_acquire)) {
+            cpu_relax();
+        }
+        void *external = pr->partials + pr->pool->num_threads * pr->stride;
+        if (partial != NULL) {
+            pr->combine(pr->ctx, external, partial);
+        } else {
+            pr->reduce(pr->ctx, begin, end, external);
+        }
+        atomic_flag_clear_explicit(&pr->external_lock, memory_order_release);
+    }
+
+    if (partial != buffer) {
+        free(partial);
+    }
+}
+
+void thread_pool_parallel_reduce(thread_pool_t *pool, size_t begin, size_t end, size_t grain,
+                                 const void *identity, void *result, size_t size,
+                                 thread_pool_reduce_fn_t *reduce, thread_pool_combine_fn_t *combine, void *ctx)
+{
+    assert(pool != NULL);
+    assert(identity != NULL && result != NULL);
+    assert(reduce != NULL && combine != NULL);
+
+    memmove(result, identity, size);
+    if (begin >= end) {
+        return;
+    }
+
+    size_t num_partials = pool->num_threads + 1;
+    size_t stride = (size + CACHE_LINE_SIZE - 1) & ~(size_t)(CACHE_LINE_SIZE - 1);
+    unsigned char *partials = aligned_malloc(CACHE_LINE_SIZE, stride * num_partials);
+    if (partials == NULL) {
+        // Not worth failing for
+        reduce(ctx, begin, end, result);
+        return;
+    }
+    for (size_t i = 0; i < num_partials; ++i) {
+        memcpy(partials + i * stride, identity, size);
+    }
+
+    parallel_reduce_t pr = {
+        .pool = pool,
+        .reduce = reduce,
+        .combine = combine,
+        .ctx = ctx,
+        .identity = identity,
+        .size = size,
+        .partials = partials,
+        .stride = stride,
+    };
+    atomic_flag_clear(&pr.external_lock);
+    thread_pool_parallel_for(pool, begin, end, grain, parallel_reduce_body, &pr);
+
+    // Pairwise, the partial i + step being combined into the partial i
+    for (size_t step = 1; step < num_partials; step *= 2) {
+        for (size_t i = 0; i + step < num_partials; i += 2 * step) {
+            combine(ctx, partials + i * stride, partials + (i + step) * stride);
+        }
+    }
+    memcpy(result, partials, size);
+    aligned_free(partials);
+}
+
+/// Shared state of a parallel scan, the range is cut in blocks
+typedef struct parallel_scan_s {
+    thread_pool_reduce_fn_t *reduce;
+    thread_pool_scan_fn_t *scan;
+    void *ctx;
+    size_t begin;
+    size_t end;
+    size_t block_size;
+    /// Result of each block, then what comes before each block
+    unsigned char *sums;
+    size_t stride;
+} parallel_scan_t;
+
+/// Number of blocks per worker of a parallel scan, more blocks
+/// balance the load better but make the serial pass longer
+#define SCAN_BLOCKS_PER_THREAD 4
+
+static void parallel_scan_reduce_body(void *arg, size_t first_block, size_t last_block) {
+    parallel_scan_t *ps = arg;
+    for (size_t block = first_block; block < last_block; ++block) {
+        size_t begin = ps->begin + block * ps->block_size;
+        ps->reduce(ps->ctx, begin, begin + ps->block_size, ps->sums + block * ps->stride);
+    }
+}
+
+static void parallel_scan_scan_body(void *arg, size_t first_block, size_t last_block) {
+    parallel_scan_t *ps = arg;
+    for (size_t block = first_block; block < last_block; ++block) {
+        size_t begin = ps->begin + block * ps->block_size;
+        size_t end = ps->end - begin > ps->block_size ? begin + ps->block_size : ps->end;
+        ps->scan(ps->ctx, begin, end, ps->sums + block * ps->stride);
+    }
+}
+
+void thread_pool_parallel_scan(thread_pool_t *pool, size_t begin, size_t end, size_t grain,
+                               const void *identity, size_t size, thread_pool_reduce_fn_t *reduce,
+                               thread_pool_combine_fn_t *combine, thread_pool_scan_fn_t *scan, void *ctx)
+{
+    assert(pool != NULL);
+    assert(identity != NULL);
+    assert(reduce != NULL && combine != NULL && scan != NULL);
+
+    if (begin >= end) {
+        return;
+    }
+    if (grain == 0) {
+        grain = 1;
+    }
+
+    size_t count = end - begin;
+    size_t num_blocks = pool->num_threads * SCAN_BLOCKS_PER_THREAD;
+    size_t block_size = count / num_blocks + (count % num_blocks != 0);
+    if (block_size < grain) {
+        block_size = grain;
+    }
+    num_blocks = count / block_size + (count % block_size != 0);
+
+    // Plus the running total and a temporary
+    size_t stride = (size + CACHE_LINE_SIZE - 1) & ~(size_t)(CACHE_LINE_SIZE - 1);
+    unsigned char *sums = NULL;
+    if (num_blocks > 1) {
+        sums = aligned_malloc(CACHE_LINE_SIZE, stride * (num_blocks + 2));
+    }
+    if (sums == NULL) {
+        scan(ctx, begin, end, identity);
+        return;
+    }
+    for (size_t block = 0; block < num_blocks; ++block) {
+        memcpy(sums + block * stride, identity, size);
+    }
+
+    parallel_scan_t ps = {
+        .reduce = reduce,
+        .scan = scan,
+        .ctx = ctx,
+        .begin = begin,
+        .end = end,
+        .block_size = block_size,
+        .sums = sums,
+        .stride = stride,
+    };
+
+    // The last block's result is not needed, nothing comes after it
+    thread_pool_parallel_for(pool, 0, num_blocks - 1, 1, parallel_scan_reduce_body, &ps);
+
+    unsigned char *total = sums + num_blocks * stride;
+    unsigned char *temporary = total + stride;
+    memcpy(total, identity, size);
+    for (size_t block = 0; block < num_blocks; ++block) {
+        unsigned char *sum = sums + block * stride;
+        memcpy(temporary, sum, size);
+        memcpy(sum, total, size);
+        if (block + 1 < num_blocks) {
+            combine(ctx, total, temporary);
+        }
+    }
+
+    thread_pool_parallel_for(pool, 0, num_blocks, 1, parallel_scan_scan_body, &ps);
+    aligned_free(sums);
+}
+
+thread_pool_group_t * thread_pool_group_create(thread_pool_t *pool) {
+    assert(pool != NULL);
+
+    thread_pool_group_t *group = aligned_malloc(_Alignof(thread_pool_group_t), sizeof(*group));
+    if (group == NULL) {
+        return NULL;
+    }
+    group_init(group, pool);
+    return group;
+}
+
+void thread_pool_group_add_task(thread_pool_group_t *group, thread_task_fn_t *fn, void *arg) {
+    assert(group != NULL);
+
+    thread_task_t task = task_init(fn, arg);
+    task.group = group;
+    group_add(group, 1);
+    pool_push_task(group->pool, &task);
+}
+
+void thread_pool_group_add_tasks(thread_pool_group_t *group, thread_task_fn_t *fn, void *args, size_t count, size_t stride) {
+    assert(group != NULL);
+
+    thread_task_t task = task_init(fn, NULL);
+    task.group = group;
+    group_add(group, count);
+    pool_push_tasks(group->pool, &task, args, count, stride);
+}
+
+void thread_pool_group_wait(thread_pool_group_t *group) {
+    assert(group != NULL);
+    group_wait(group);
+}
+
+void thread_pool_group_delete(thread_pool_group_t *group) {
+    if (group == NULL) {
+        return;
+    }
+    group_wait(group);
+    aligned_free(group);
+}
+
+/// Stops and joins all the threads of the pool
+///
+/// Workers finish the task they run, then exit without taking any other.
+/// The tasks that wait set the queued ones aside until their wait is over
+static void pool_stop_threads(thread_pool_t *pool) {
+    int status = mutex_lock(&pool->mutex);
+    assert(status == 0);
+    atomic_store(&pool->stop_requested, true);
+    pool_wake_all(pool);
+    // Set with the mutex held, so that the monitor starts no worker afterwards
+    atomic_store(&pool->monitor_stop, 1);
+    futex_wake_all(&pool->monitor_stop);
+    status = mutex_unlock(&pool->mutex);
+    assert(status == 0);
+    (void)status;
+
+    if (pool->monitor_last_started != NULL) {
+        status = thread_join(&pool->monitor);
+        assert(status == 0);
+    }
+    for (size_t i = 0; i < pool->num_threads; ++i) {
+        thread_worker_t *worker = &pool->workers[i];
+        if (worker->joinable) {
+            status = thread_join(&worker->thread);
+            assert(status == 0);
+            worker->joinable = false;
+        }
+    }
+}
+
+/// Takes the tasks left in the queues once the threads are joined,
+/// with the ones set aside by the threads that waited while stopping
+///
+/// \return The number of tasks stored in *abandoned
+static size_t pool_abandon_tasks(thread_pool_t *pool, thread_pool_abandoned_task_t **abandoned) {
+    uint64_t rng_state = 1;
+    thread_task_t task;
+    while (pool_find_task(pool, NULL, &rng_state, &task)) {
+        pool_abandon_task(pool, &task);
+    }
+
+    if (abandoned == NULL || pool->num_abandoned == 0) {
+        return 0;
+    }
+    // The array is handed over as is
+    *abandoned = pool->abandoned_tasks;
+    pool->abandoned_tasks = NULL;
+    return pool->num_abandoned;
+}
+
+size_t thread_pool_delete_ex(thread_pool_t *pool, thread_pool_delete_mode_t mode,
+                             thread_pool_abandoned_task_t **abandoned) {
+    if (abandoned != NULL) {
+        *abandoned = NULL;
+    }
+    if (pool == NULL) {
+        return 0;
+    }
+
+    if (mode == THREAD_POOL_DELETE_ABANDON && abandoned != NULL) {
+        // Room for the tasks queued so far, the pool is left as is if there is none
+        int status = mutex_lock(&pool->mutex);
+        assert(status == 0);
+        bool reserved = pool_reserve_abandoned(pool, atomic_load(&pool->pending));
+        pool->keep_abandoned = reserved;
+        status = mutex_unlock(&pool->mutex);
+        assert(status == 0);
+        (void)status;
+        if (!reserved) {
+            return SIZE_MAX;
+        }
+    }
+
+    // Pending timers are dropped, the tasks of the ones that fired
+    // are queued like any other task
+    pool_stop_timers(pool);
+
+    if (mode == THREAD_POOL_DELETE_DRAIN) {
+        // Let the queued tasks run to completion before stopping
+        thread_pool_wait(pool);
+    }
+    pool_stop_threads(pool);
+
+    size_t count = 0;
+    if (mode == THREAD_POOL_DELETE_ABANDON) {
+        count = pool_abandon_tasks(pool, abandoned);
+    }
+
+    mutex_destroy(&pool->mutex);
+    condvar_destroy(&pool->cond_thread_done);
+    mutex_destroy(&pool->timers.mutex);
+    pool_free(pool, pool->num_threads);
+    return count;
+}
+
+void thread_pool_delete(thread_pool_t *pool)
+{
+    (void)thread_pool_delete_ex(pool, THREAD_POOL_DELETE_DRAIN, NULL);
 }
 
 size_t thread_pool_num_threads(thread_pool_t *pool) {
     assert(pool != NULL);
     return pool->num_threads;
 }
+
+size_t thread_pool_num_active_threads(thread_pool_t *pool) {
+    assert(pool != NULL);
+    int status = mutex_lock(&pool->mutex);
+    assert(status == 0);
+    size_t num_active = pool->num_active;
+    status = mutex_unlock(&pool->mutex);
+    assert(status == 0);
+    (void)status;
+    return num_active;
+}
+
+/// Copies the counters of a slot to the public structure
+static void worker_stats_read(const worker_stats_t *stats, thread_pool_worker_stats_t *out) {
+    out->tasks_executed = atomic_load_explicit(&stats->tasks_executed, memory_order_relaxed);
+    out->tasks_stolen = atomic_load_explicit(&stats->tasks_stolen, memory_order_relaxed);
+    out->busy_ns = atomic_load_explicit(&stats->busy_ns, memory_order_relaxed);
+    out->idle_ns = atomic_load_explicit(&stats->idle_ns, memory_order_relaxed);
+    out->lock_wait_ns = atomic_load_explicit(&stats->lock_wait_ns, memory_order_relaxed);
+    out->max_queue_depth = atomic_load_explicit(&stats->max_queue_depth, memory_order_relaxed);
+    for (size_t i = 0; i < THREAD_POOL_STATS_BUCKETS; ++i) {
+        out->queue_wait_histogram[i] = atomic_load_explicit(&stats->queue_wait_histogram[i], memory_order_relaxed);
+        out->run_time_histogram[i] = atomic_load_explicit(&stats->run_time_histogram[i], memory_order_relaxed);
+    }
+}
+
+/// Adds the counters of stats to total, depths being maxed rather than summed
+static void worker_stats_accumulate(thread_pool_worker_stats_t *total, const thread_pool_worker_stats_t *stats) {
+    total->tasks_executed += stats->tasks_executed;
+    total->tasks_stolen += stats->tasks_stolen;
+    total->busy_ns += stats->busy_ns;
+    total->idle_ns += stats->idle_ns;
+    total->lock_wait_ns += stats->lock_wait_ns;
+    total->queue_depth += stats->queue_depth;
+    if (stats->max_queue_depth > total->max_queue_depth) {
+        total->max_queue_depth = stats->max_queue_depth;
+    }
+    for (size_t i = 0; i < THREAD_POOL_STATS_BUCKETS; ++i) {
+        total->queue_wait_histogram[i] += stats->queue_wait_histogram[i];
+        total->run_time_histogram[i] += stats->run_time_histogram[i];
+    }
+}
+
+void thread_pool_get_stats(thread_pool_t *pool, thread_pool_stats_t *stats, thread_pool_worker_stats_t *worker_stats) {
+    assert(pool != NULL);
+    assert(stats != NULL);
+
+    memset(stats, 0, sizeof(*stats));
+    stats->enabled = pool->stats != NULL;
+    stats->num_workers = pool->num_threads;
+    stats->num_allocations = atomic_load_explicit(&pool->num_allocations, memory_order_relaxed);
+    stats->tasks_cancelled = atomic_load_explicit(&pool->num_cancelled, memory_order_relaxed);
+    stats->tasks_expired = atomic_load_explicit(&pool->num_expired, memory_order_relaxed);
+
+    for (size_t i = 0; i <= pool->num_threads; ++i) {
+        thread_pool_worker_stats_t current;
+        memset(&current, 0, sizeof(current));
+        if (pool->stats != NULL) {
+            worker_stats_read(&pool->stats[i], &current);
+        }
+
+        if (i < pool->num_threads) {
+            current.queue_depth = task_deque_size(&pool->workers[i].deque);
+            if (worker_stats != NULL) {
+                worker_stats[i] = current;
+            }
+        } else {
+            // The queues shared by all threads
+            current.queue_depth = atomic_load_explicit(&pool->num_injected, memory_order_relaxed);
+            if (pool->ring.cells != NULL) {
+                current.queue_depth += mpmc_ring_size(&pool->ring);
+            }
+            for (size_t n = 0; n < pool->num_nodes; ++n) {
+                current.queue_depth += atomic_load_explicit(&pool->nodes[n].num_tasks, memory_order_relaxed);
+            }
+            stats->external = current;
+        }
+        worker_stats_accumulate(&stats->total, &current);
+    }
+}
+
+/// Writes the string as the content of a JSON string
+static void trace_write_escaped(FILE *file, const char *string) {
+    for (const unsigned char *c = (const unsigned char *)string; *c != '\0'; ++c) {
+        if (*c == '"' || *c == '\\') {
+            fprintf(file, "\\%c", *c);
+        } else if (*c < 0x20) {
+            fprintf(file, "\\u%04x", *c);
+        } else {
+            fputc(*c, file);
+        }
+    }
+}
+
+int thread_pool_trace_dump(thread_pool_t *pool, FILE *file) {
+    assert(pool != NULL);
+    assert(file != NULL);
+    if (pool->traces == NULL) {
+        return -1;
+    }
+
+    fprintf(file, "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[\n");
+    for (size_t i = 0; i <= pool->num_threads; ++i) {
+        fprintf(file, "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%zu,\"args\":{\"name\":", i);
+        if (i < pool->num_threads) {
+            fprintf(file, "\"worker %zu\"}},\n", i);
+        } else {
+            fprintf(file, "\"external\"}},\n");
+        }
+    }
+
+    bool first = true;
+    for (size_t i = 0; i <= pool->num_threads; ++i) {
+        trace_ring_t *ring = &pool->traces[i];
+        uint64_t head = atomic_load_explicit(&ring->head, memory_order_acquire);
+        uint64_t capacity = (uint64_t)ring->mask + 1;
+        for (uint64_t n = head > capacity ? head - capacity : 0; n < head; ++n) {
+            trace_event_t *event = &ring->events[n & ring->mask];
+            uint64_t sequence = atomic_load_explicit(&event->sequence, memory_order_acquire);
+            uint64_t enqueue_time = atomic_load_explicit(&event->enqueue_time, memory_order_relaxed);
+            uint64_t start = atomic_load_explicit(&event->start, memory_order_relaxed);
+            uint64_t end = atomic_load_explicit(&event->end, memory_order_relaxed);
+            const char *label = atomic_load_explicit(&event->label, memory_order_relaxed);
+            atomic_thread_fence(memory_order_acquire);
+            // Skips events being written or already overwritten
+            if (sequence != 2 * n + 2 || atomic_load_explicit(&event->sequence, memory_order_relaxed) != sequence) {
+                continue;
+            }
+
+            fprintf(file, "%s{\"name\":\"", first ? "" : ",\n");
+            trace_write_escaped(file, label != NULL ? label : "task");
+            fprintf(file, "\",\"ph\":\"X\",\"pid\":1,\"tid\":%zu,\"ts\":%.3f,\"dur\":%.3f,"
+                          "\"args\":{\"queued_us\":%.3f}}",
+                    i, (double)(start - pool->trace_start) / 1e3, (double)(end - start) / 1e3,
+                    enqueue_time != 0 && enqueue_time < start ? (double)(start - enqueue_time) / 1e3 : 0.0);
+            first = false;
+        }
+    }
+    fprintf(file, "\n]}\n");
+    return ferror(file) ? -1 : 0;
+}
+
+size_t thread_pool_current_worker_index(void) {
+    thread_worker_t *worker = current_worker;
+    task_frame_t *frame = current_frame;
+    // A worker waiting from a task of another pool may run that pool's tasks,
+    // its index is meaningless to them
+    if (worker == NULL || (frame != NULL && frame->pool != worker->pool)) {
+        return THREAD_POOL_NOT_A_WORKER;
+    }
+    return worker->index;
+}
+
+void thread_pool_blocking_begin(void) {
+    thread_worker_t *worker = current_worker;
+    if (worker == NULL || worker->blocking_depth++ != 0) {
+        return;
+    }
+    thread_pool_t *pool = worker->pool;
+
+    int status = mutex_lock(&pool->mutex);
+    assert(status == 0);
+    pool->num_blocked += 1;
+    // Once stopping, the threads are being joined and no worker may start
+    if (pool->num_active - pool->num_blocked < pool->base_threads
+        && !atomic_load_explicit(&pool->stop_requested, memory_order_relaxed)) {
+        // Workers of the same node first, the compensating worker takes over the node's tasks
+        pool_node_t *node = &pool->nodes[worker->node];
+        thread_worker_t *inactive = NULL;
+        for (size_t i = 0; i < pool->num_threads && inactive == NULL; ++i) {
+            thread_worker_t *candidate = &pool->workers[(node->first_worker + i) % pool->num_threads];
+            inactive = candidate->active ? NULL : candidate;
+        }
+        if (inactive != NULL) {
+            (void)pool_start_worker(pool, inactive);
+        }
+    }
+    pool_update_surplus(pool);
+    status = mutex_unlock(&pool->mutex);
+    assert(status == 0);
+    (void)status;
+}
+
+void thread_pool_blocking_end(void) {
+    thread_worker_t *worker = current_worker;
+    if (worker == NULL) {
+        return;
+    }
+    assert(worker->blocking_depth != 0);
+    if (--worker->blocking_depth != 0) {
+        return;
+    }
+    thread_pool_t *pool = worker->pool;
+
+    int status = mutex_lock(&pool->mutex);
+    assert(status == 0);
+    pool->num_blocked -= 1;
+    pool_update_surplus(pool);
+    bool surplus = atomic_load_explicit(&pool->num_surplus, memory_order_relaxed) != 0;
+    status = mutex_unlock(&pool->mutex);
+    assert(status == 0);
+    (void)status;
+
+    if (surplus) {
+        // Idle workers retire when they wake up and see nothing to do
+        pool_wake_all(pool);
+    }
+}
+
+void *thread_pool_scratch_alloc(size_t size) {
+    if (current_task_depth == 0) {
+        return NULL;
+    }
+    return scratch_arena_alloc(current_scratch_arena(), size);
+}
+
+size_t thread_pool_num_allocations(thread_pool_t *pool) {
+    assert(pool != NULL);
+    return atomic_load_explicit(&pool->num_allocations, memory_order_relaxed);
+}
@@ -1,11 +1,23 @@
 #ifndef THREAD_POOL_H
 #define THREAD_POOL_H
 
+#include <stddef.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+
 typedef struct thread_pool_s thread_pool_t;
 
+/// A set of tasks of a pool that can be waited on
+/// independently of the other tasks of the pool
+typedef struct thread_pool_group_s thread_pool_group_t;
+
 /// The signature of a function (task) a thread can execute
 typedef void(thread_task_fn_t)(void*);
 
+/// Maximum number of bytes thread_pool_add_task_inline can copy into a task
+#define THREAD_POOL_INLINE_DATA_SIZE 48
+
 /// Creates a thread pool
 ///
 /// \param num_threads tells how many threads the pool should have.
@@ -14,18 +26,492 @@ typedef void(thread_task_fn_t)(void*);
 /// \return The thread pool or NULL in case of error
 thread_pool_t * thread_pool_create(size_t num_threads);
 
+/// Options to create a thread pool with thread_pool_create_ex
+typedef struct thread_pool_options_s {
+    /// How many threads the pool should have,
+    /// zero means one per CPU thread of the machine
+    size_t num_threads;
+    /// When not zero, tasks added from threads that are not part of the pool
+    /// go through a lock-free ring buffer of (at least) that many tasks,
+    /// allocated once at creation, instead of a linked list of task nodes.
+    ///
+    /// When the ring is full, thread_pool_add_task waits for workers to make room,
+    /// see thread_pool_try_add_task and thread_pool_add_task_timeout to
+    /// not wait, or not for too long.
+    size_t queue_capacity;
+    /// Pins each worker to a single CPU
+    bool pin_threads;
+    /// Only uses the CPUs the process is allowed to run on (e.g. set by
+    /// taskset or a container), also when choosing the number of threads
+    bool use_process_cpuset;
+    /// Spreads the workers evenly over the NUMA nodes (Linux reads them from /sys),
+    /// each worker staying on its node.
+    ///
+    /// Workers then steal from workers of their node first, and tasks
+    /// added from threads outside of the pool go to the node of the CPU
+    /// the submitting thread runs on (unless queue_capacity is used)
+    bool numa_aware;
+    /// Collects the counters returned by thread_pool_get_stats,
+    /// this reads the clock a few times per task
+    bool collect_stats;
+    /// When not zero, each worker records the last (at least) trace_events
+    /// tasks it ran, see thread_pool_trace_dump.
+    /// This reads the clock a few times per task and uses about 40 bytes per event
+    size_t trace_events;
+    /// Size of the first block of the scratch arena of each worker,
+    /// see thread_pool_scratch_alloc, allocated on first use
+    size_t scratch_size;
+    /// Makes the pool elastic when below num_threads: workers idle for
+    /// idle_timeout_ms stop their thread, down to min_threads workers.
+    /// Zero means num_threads
+    size_t min_threads;
+    /// Makes the pool elastic when above num_threads: when tasks stay queued
+    /// for spawn_delay_ms while workers are stuck in a task (e.g. blocked
+    /// on I/O) and none is idle, one more worker is started, up to max_threads.
+    /// Workers started for tasks in a blocking region (see
+    /// thread_pool_blocking_begin) are also limited by it, there are none
+    /// unless it is raised.
+    /// Zero means num_threads
+    size_t max_threads;
+    /// How long a worker above min_threads waits for a task before stopping
+    unsigned idle_timeout_ms;
+    /// How often to check whether a worker must be started, up to max_threads
+    unsigned spawn_delay_ms;
+} thread_pool_options_t;
+
+/// Sets the options to their default values
+void thread_pool_options_init(thread_pool_options_t *options);
+
+/// Creates a thread pool configured by the options
+///
+/// \return The thread pool or NULL in case of error
+thread_pool_t * thread_pool_create_ex(const thread_pool_options_t *options);
+
 /// Adds a task to be picked up by threads of the pool
 void thread_pool_add_task(thread_pool_t *pool, thread_task_fn_t *fn, void* arg);
 
-/// Blocks the current thread until all tasks are done
+/// Adds a task to be picked up preferably by workers of the NUMA node
+///
+/// Other workers still pick it up when they have nothing else to do.
+/// When the pool has a queue_capacity, threads outside of the pool add
+/// the task as with thread_pool_add_task, so that the capacity holds.
+///
+/// \param node is the node number given by the OS, when the pool was not
+///  created with numa_aware or has no worker on that node,
+///  this is the same as thread_pool_add_task
+void thread_pool_add_task_on_node(thread_pool_t *pool, thread_task_fn_t *fn, void *arg, int node);
+
+/// Result of the functions adding a task that may refuse it
+typedef enum thread_pool_status_e {
+    THREAD_POOL_OK,
+    /// The queue is full
+    THREAD_POOL_FULL,
+    /// The queue stayed full for the whole timeout
+    THREAD_POOL_TIMEOUT,
+} thread_pool_status_t;
+
+/// Same as thread_pool_add_task, but returns THREAD_POOL_FULL right away
+/// instead of waiting when the queue is full
+///
+/// Only pools created with a queue_capacity have a queue that can be full,
+/// and only for tasks added from threads that are not part of the pool:
+/// tasks added from within a task are always accepted
+thread_pool_status_t thread_pool_try_add_task(thread_pool_t *pool, thread_task_fn_t *fn, void *arg);
+
+/// Same as thread_pool_try_add_task, but waits up to timeout_ms
+/// for room in the queue, returning THREAD_POOL_TIMEOUT if there is none
+thread_pool_status_t thread_pool_add_task_timeout(thread_pool_t *pool, thread_task_fn_t *fn, void *arg,
+                                                  unsigned timeout_ms);
+
+/// Same as thread_pool_add_task, the task being named label in traces
+///
+/// \param label is not copied, it must outlive the pool (e.g. a string literal)
+void thread_pool_add_task_labeled(thread_pool_t *pool, thread_task_fn_t *fn, void *arg, const char *label);
+
+/// Same as thread_pool_add_task, but the task is dropped instead of run
+/// when it did not start within timeout_ns, see thread_pool_stats_s::tasks_expired
+void thread_pool_add_task_deadline(thread_pool_t *pool, thread_task_fn_t *fn, void *arg, uint64_t timeout_ns);
+
+/// Handle of a task added with thread_pool_add_cancellable_task
+typedef struct thread_pool_task_handle_s thread_pool_task_handle_t;
+
+/// States of a task that has a handle
+typedef enum thread_pool_task_state_e {
+    THREAD_POOL_TASK_QUEUED,
+    /// The task is running
+    THREAD_POOL_TASK_STARTED,
+    /// The task ran to completion
+    THREAD_POOL_TASK_DONE,
+    /// The task was cancelled before it started, it will not run
+    THREAD_POOL_TASK_CANCELLED,
+    /// The task did not start before its deadline, it will not run
+    THREAD_POOL_TASK_EXPIRED,
+} thread_pool_task_state_t;
+
+/// Same as thread_pool_add_task, returning a handle to cancel the task
+/// as long as it did not start
+///
+/// A cancelled task still goes through the queue, the worker picking it up
+/// drops it instead of running it, and thread_pool_wait waits for that.
+///
+/// \param timeout_ns when not zero, the task is dropped when it did not start
+///  within that time, like with thread_pool_add_task_deadline
+/// \return The handle, to be released with thread_pool_task_handle_release,
+///  or NULL in case of error (the task is then not added)
+thread_pool_task_handle_t * thread_pool_add_cancellable_task(thread_pool_t *pool, thread_task_fn_t *fn, void *arg,
+                                                             uint64_t timeout_ns);
+
+/// Cancels the task if it did not start
+///
+/// \return True if the task will not run, false if it started or
+///  was already cancelled or dropped
+bool thread_pool_cancel_task(thread_pool_task_handle_t *handle);
+
+/// Returns the state of the task, the state is THREAD_POOL_TASK_DONE
+/// (or one of the dropped ones) once a wait covering the task returned
+thread_pool_task_state_t thread_pool_task_state(const thread_pool_task_handle_t *handle);
+
+/// Releases the handle, the task is not affected
+///
+/// handle may be NULL
+void thread_pool_task_handle_release(thread_pool_task_handle_t *handle);
+
+/// Handle of a delayed or periodic task, 0 is never a valid handle
+typedef uint64_t thread_pool_timer_t;
+
+/// Adds a task once delay_ns elapsed
+///
+/// Timers have a resolution of a millisecond, the delay being rounded up,
+/// and are driven by a single thread of the pool, started with the first timer.
+/// Once due, the task is queued like one added with thread_pool_add_task.
+///
+/// thread_pool_wait only waits for tasks whose timer fired,
+/// and timers that did not fire when the pool is deleted are dropped.
+///
+/// \return A handle for thread_pool_cancel_timer or 0 in case of error
+thread_pool_timer_t thread_pool_add_task_after(thread_pool_t *pool, uint64_t delay_ns, thread_task_fn_t *fn, void *arg);
+
+/// Adds a task once delay_ns elapsed, then every period_ns until cancelled
+///
+/// Runs are not skipped while a previous one is queued or running,
+/// only the ones the timer thread is too late for are.
+///
+/// \return A handle for thread_pool_cancel_timer or 0 in case of error
+thread_pool_timer_t thread_pool_add_periodic_task(thread_pool_t *pool, uint64_t delay_ns, uint64_t period_ns,
+                                                  thread_task_fn_t *fn, void *arg);
+
+/// Cancels a delayed task that is not yet queued, or stops a periodic one
+/// (its queued or running run still completes)
+///
+/// \return True if the timer was cancelled, false if it already fired
+///  (for delayed tasks), was cancelled before or the handle is 0
+bool thread_pool_cancel_timer(thread_pool_t *pool, thread_pool_timer_t timer);
+
+/// Priority levels of tasks
+typedef enum thread_pool_priority_e {
+    THREAD_POOL_PRIORITY_HIGH,
+    THREAD_POOL_PRIORITY_NORMAL,
+    THREAD_POOL_PRIORITY_LOW,
+    THREAD_POOL_NUM_PRIORITIES,
+} thread_pool_priority_t;
+
+/// Adds a task with the given priority
+///
+/// High priority tasks are picked up before any other queued task.
+/// Normal priority is what thread_pool_add_task uses.
+/// Low priority tasks are picked up when there is nothing else to do,
+/// or after being passed over for a while, so they cannot starve.
+///
+/// High and low priority tasks go through a queue shared by all threads,
+/// normal ones keep the faster per-worker queues.
+/// Priorities only order queued tasks, running tasks are never interrupted.
+void thread_pool_add_task_prio(thread_pool_t *pool, thread_task_fn_t *fn, void *arg, thread_pool_priority_t priority);
+
+/// Adds a task whose argument is a copy of the len bytes at data
+///
+/// The bytes are stored in the task itself, so data does not need to
+/// outlive the call. fn is given a pointer to the copy, suitably aligned
+/// for any type, that is valid until fn returns.
+///
+/// \param len must be at most THREAD_POOL_INLINE_DATA_SIZE
+void thread_pool_add_task_inline(thread_pool_t *pool, thread_task_fn_t *fn, const void *data, size_t len);
+
+/// Adds count tasks at once, task i is given `(char *)args + i * stride`
+///
+/// This is cheaper than calling thread_pool_add_task count times,
+/// the queue is locked (if at all) and workers are woken up only once.
+///
+/// \param stride is in bytes, e.g. `sizeof(*args)` to give each task
+///  one element of an array, or 0 to give all tasks the same argument
+void thread_pool_add_tasks(thread_pool_t *pool, thread_task_fn_t *fn, void *args, size_t count, size_t stride);
+
+/// The signature of the body of a parallel for,
+/// called on sub ranges [begin, end) of the whole range
+typedef void(thread_pool_range_fn_t)(void *ctx, size_t begin, size_t end);
+
+/// Calls body on sub ranges covering [begin, end) using the threads of the pool
+/// and the calling thread, returns once the whole range is done.
+///
+/// Can be called from within a task.
+///
+/// The range starts split in one piece per thread the pool has at the time,
+/// a piece is split in half again only when a worker runs out of work.
+///
+/// \param grain is the minimum number of iterations body is called with
+///  (except for the last sub range), 0 is the same as 1. Sub ranges start
+///  a whole number of grains after begin
+void thread_pool_parallel_for(thread_pool_t *pool, size_t begin, size_t end, size_t grain,
+                              thread_pool_range_fn_t *body, void *ctx);
+
+/// The signature of the function accumulating the elements [begin, end)
+/// of a reduction into partial, a partial result of the size given to
+/// thread_pool_parallel_reduce
+typedef void(thread_pool_reduce_fn_t)(void *ctx, size_t begin, size_t end, void *partial);
+
+/// The signature of the function combining the partial result src into dest,
+/// dest holding the result of elements that come before the ones of src
+typedef void(thread_pool_combine_fn_t)(void *ctx, void *dest, const void *src);
+
+/// Computes the reduction of the elements [begin, end) into result,
+/// the size bytes at identity being the result of no element
+///
+/// Sub ranges are reduced like with thread_pool_parallel_for, each one
+/// being accumulated on the stack (on the heap above 256 bytes), then
+/// combined into the partial result of the worker, on its own cache lines.
+/// The partial results are then combined pairwise. reduce may wait
+/// (e.g. run a nested parallel loop).
+///
+/// combine must be associative and commutative (sub ranges are not
+/// accumulated in order), floating point sums can therefore differ
+/// slightly from a serial loop and between runs.
+///
+/// \param size is the number of bytes of partial results
+void thread_pool_parallel_reduce(thread_pool_t *pool, size_t begin, size_t end, size_t grain,
+                                 const void *identity, void *result, size_t size,
+                                 thread_pool_reduce_fn_t *reduce, thread_pool_combine_fn_t *combine, void *ctx);
+
+/// The signature of the function writing the inclusive scan of [begin, end),
+/// prefix being the result of all the elements before begin
+typedef void(thread_pool_scan_fn_t)(void *ctx, size_t begin, size_t end, const void *prefix);
+
+/// Computes a prefix scan of the elements [begin, end) in two passes
+///
+/// The range is cut in a few blocks per worker (of at least grain elements),
+/// reduce computes the result of each block but the last one, then
+/// the results are combined in order to get the prefix of each block
+/// that scan is called with.
+///
+/// combine must be associative, it does not need to be commutative.
+///
+/// \param size is the number of bytes of partial results
+void thread_pool_parallel_scan(thread_pool_t *pool, size_t begin, size_t end, size_t grain,
+                               const void *identity, size_t size, thread_pool_reduce_fn_t *reduce,
+                               thread_pool_combine_fn_t *combine, thread_pool_scan_fn_t *scan, void *ctx);
+
+/// Blocks the current thread until all tasks are done,
+/// including the ones currently running
+///
+/// While waiting, the calling thread runs queued tasks of the pool.
+/// When called from a task of the pool, only waits for the tasks that
+/// task added with the thread_pool_add_task functions (not the ones
+/// they add themselves), which allows recursive fork-join.
+///
+/// Use a thread_pool_group_t to only wait for some of the tasks
 void thread_pool_wait(thread_pool_t *pool);
 
-/// Blocks until tasks and threads shutdown, then deletes the pool
+/// Creates an empty group of tasks that will run on the pool
+///
+/// \return The group or NULL in case of error
+thread_pool_group_t * thread_pool_group_create(thread_pool_t *pool);
+
+/// Adds a task to the group's pool, the task being part of the group
+void thread_pool_group_add_task(thread_pool_group_t *group, thread_task_fn_t *fn, void *arg);
+
+/// Same as thread_pool_add_tasks, all the tasks being part of the group
+void thread_pool_group_add_tasks(thread_pool_group_t *group, thread_task_fn_t *fn, void *args, size_t count, size_t stride);
+
+/// Blocks the current thread until all tasks of the group are done,
+/// tasks that are not part of the group are not waited for.
+///
+/// While waiting, the calling thread runs queued tasks of the pool,
+/// so tasks can wait on groups of sub tasks (fork-join) without deadlocking the pool.
 ///
+/// The group can be reused afterwards
+void thread_pool_group_wait(thread_pool_group_t *group);
+
+/// Waits for the group's tasks then deletes the group
+///
+/// group may be NULL
+void thread_pool_group_delete(thread_pool_group_t *group);
+
+/// Runs the queued tasks, joins the threads, then deletes the pool
+///
+/// Same as thread_pool_delete_ex with THREAD_POOL_DELETE_DRAIN.
 /// pool may be NULL
 void thread_pool_delete(thread_pool_t *pool);
 
-/// Returns the number of threads present in the pool
+/// What thread_pool_delete_ex does with the tasks still queued
+typedef enum thread_pool_delete_mode_e {
+    /// The queued tasks are run before the threads stop
+    THREAD_POOL_DELETE_DRAIN,
+    /// The threads stop once done with the task they run, the queued
+    /// tasks are not run but given back to the caller. A task waiting
+    /// meanwhile runs no other task, its wait is over once the tasks it
+    /// waits for have run or been abandoned
+    THREAD_POOL_DELETE_ABANDON,
+} thread_pool_delete_mode_t;
+
+/// A task that was still queued when the pool was deleted
+typedef struct thread_pool_abandoned_task_s {
+    thread_task_fn_t *fn;
+    /// The argument fn was to be given, pointing to data
+    /// for tasks added with thread_pool_add_task_inline
+    void *arg;
+    union {
+        max_align_t align;
+        unsigned char bytes[THREAD_POOL_INLINE_DATA_SIZE];
+    } data;
+} thread_pool_abandoned_task_t;
+
+/// Stops and joins the threads, then deletes the pool
+///
+/// Pending delayed and periodic tasks are dropped in both modes.
+/// Abandoned tasks count as done for their group, cancellable ones
+/// are marked cancelled (those already cancelled are not given back).
+///
+/// A task added while the pool stops that cannot be given back
+/// for lack of memory is run instead.
+///
+/// \param abandoned receives the array of the abandoned tasks, to be freed
+///  with free, or NULL when there are none. May be NULL to drop them
+/// \return The number of tasks in *abandoned, or SIZE_MAX when there is
+///  no memory for the array, in which case the pool is not deleted
+size_t thread_pool_delete_ex(thread_pool_t *pool, thread_pool_delete_mode_t mode,
+                             thread_pool_abandoned_task_t **abandoned);
+
+/// Returns the number of workers of the pool,
+/// for elastic pools this is the maximum number of threads
 size_t thread_pool_num_threads(thread_pool_t *pool);
 
+/// Returns the number of workers currently having a thread
+size_t thread_pool_num_active_threads(thread_pool_t *pool);
+
+/// Value of thread_pool_current_worker_index for threads that are not workers
+#define THREAD_POOL_NOT_A_WORKER SIZE_MAX
+
+/// Returns the index of the worker the calling thread is, in
+/// [0, thread_pool_num_threads) of its pool, or THREAD_POOL_NOT_A_WORKER
+///
+/// Allows tasks to index per worker data without locking.
+/// Also THREAD_POOL_NOT_A_WORKER when the task running is one of another
+/// pool, which the worker runs while waiting on that pool
+size_t thread_pool_current_worker_index(void);
+
+/// Tells the pool that the calling task is about to block (e.g. on I/O)
+/// until thread_pool_blocking_end is called
+///
+/// So that num_threads workers can still run tasks meanwhile, a compensating
+/// worker is started, when the pool has room for it (max_threads above num_threads).
+/// A pool made with thread_pool_create, or without raising max_threads, has no
+/// such room: it never compensates and the region is only bookkeeping.
+/// Workers above that count stop as soon as they are idle once the region ends.
+/// Regions can be nested, only the outermost one counts. Does nothing when
+/// the calling thread is not a worker.
+void thread_pool_blocking_begin(void);
+
+/// Ends the region started by the matching thread_pool_blocking_begin
+void thread_pool_blocking_end(void);
+
+/// Allocates memory private to the calling worker, that is released
+/// when the task calling this returns (it must not be freed)
+///
+/// This is a bump allocator over blocks owned by the worker, so after warming
+/// up it does not call malloc and the memory is not shared with other workers.
+/// Tasks run while the task waits get their own memory, released when they return.
+/// Tasks run by threads outside the pool while they wait also get memory,
+/// but their blocks are freed after each task.
+///
+/// \return The memory, aligned for any type, or NULL when not called
+///  from a task or in case of error
+void *thread_pool_scratch_alloc(size_t size);
+
+/// Returns how many heap allocations the pool made so far to store
+/// submitted tasks (task slabs and deque growth). The slabs also hold
+/// what thread_pool_wait needs to wait from within a task.
+///
+/// Memory is recycled, so this stops increasing once the pool
+/// has seen its peak number of queued tasks.
+size_t thread_pool_num_allocations(thread_pool_t *pool);
+
+/// Number of buckets of the histograms of thread_pool_worker_stats_t
+#define THREAD_POOL_STATS_BUCKETS 32
+
+/// Counters of a worker, or of the threads that are not part of the pool
+typedef struct thread_pool_worker_stats_s {
+    /// Number of tasks run
+    uint64_t tasks_executed;
+    /// Number of tasks taken from the queue of another worker
+    uint64_t tasks_stolen;
+    /// Time spent running tasks, tasks run while a task waits
+    /// are counted as part of the waiting task
+    uint64_t busy_ns;
+    /// Time spent with nothing to do
+    uint64_t idle_ns;
+    /// Time spent waiting for the lock of the shared queues
+    uint64_t lock_wait_ns;
+    /// Number of tasks in the worker's queue when the stats were read
+    uint64_t queue_depth;
+    /// Highest number of tasks seen in a queue right after pushing to it
+    uint64_t max_queue_depth;
+    /// Bucket i > 0 counts tasks that waited in a queue between 2^(i-1) and 2^i - 1 ns,
+    /// bucket 0 the ones that did not wait and the last bucket everything longer
+    uint64_t queue_wait_histogram[THREAD_POOL_STATS_BUCKETS];
+    /// Same as queue_wait_histogram for the time tasks took to run
+    uint64_t run_time_histogram[THREAD_POOL_STATS_BUCKETS];
+} thread_pool_worker_stats_t;
+
+/// Counters of a pool, see thread_pool_get_stats
+typedef struct thread_pool_stats_s {
+    /// Whether the pool was created with collect_stats, when false
+    /// only the queue depths, num_allocations and the dropped tasks are filled
+    bool enabled;
+    size_t num_workers;
+    /// Sum of the counters of the workers and of external,
+    /// max_queue_depth being the highest one
+    thread_pool_worker_stats_t total;
+    /// Tasks run by threads outside the pool while they wait,
+    /// the queue being the ones shared by all threads
+    /// (tasks with a priority other than normal are not counted)
+    thread_pool_worker_stats_t external;
+    /// Same as thread_pool_num_allocations
+    size_t num_allocations;
+    /// Tasks dropped because they were cancelled with thread_pool_cancel_task,
+    /// counted even when the pool does not collect stats
+    uint64_t tasks_cancelled;
+    /// Tasks dropped because their deadline passed before they started,
+    /// counted even when the pool does not collect stats
+    uint64_t tasks_expired;
+} thread_pool_stats_t;
+
+/// Reads the counters of the pool
+///
+/// Counters are read while the workers keep updating them,
+/// so they may be slightly inconsistent with each other.
+///
+/// \param worker_stats when not NULL, an array of thread_pool_num_threads(pool)
+///  elements receiving the counters of each worker
+void thread_pool_get_stats(thread_pool_t *pool, thread_pool_stats_t *stats, thread_pool_worker_stats_t *worker_stats);
+
+/// Writes the tasks recorded by the workers of a pool created with trace_events
+/// as a Chrome trace (JSON), that chrome://tracing or Perfetto can open
+///
+/// Each task is a slice on the track of the worker that ran it,
+/// with the time it spent queued as argument. Tasks run by threads
+/// outside the pool while they wait are on an "external" track.
+/// Workers keep running (and recording) tasks during the dump.
+///
+/// \return 0 on success, -1 if the pool does not record traces
+///  or in case of write error
+int thread_pool_trace_dump(thread_pool_t *pool, FILE *file);
+
 #endif // THREAD_POOL_H
@@ -0,0 +1,157 @@
+#include <stddef.h>
+#include <stdlib.h>
+#include <assert.h>
+#include <stdatomic.h>
+
+#include "thread_pool_graph.h"
+#include "thread_pool_internal.h"
+
+struct thread_pool_graph_node_s {
+    thread_task_fn_t *fn;
+    void *arg;
+    thread_pool_graph_t *graph;
+    /// Nodes that depend on this one
+    thread_pool_graph_node_t **successors;
+    size_t num_successors;
+    size_t successors_capacity;
+    /// Number of nodes this one depends on
+    size_t num_predecessors;
+    /// Number of predecessors not yet done in the current run,
+    /// the node is added to the pool when it drops to zero
+    _Atomic size_t num_remaining;
+};
+
+struct thread_pool_graph_s {
+    thread_pool_t *pool;
+    /// Tasks of the current run not yet finished
+    thread_pool_group_t *group;
+    thread_pool_graph_node_t **nodes;
+    size_t num_nodes;
+    size_t nodes_capacity;
+};
+
+static void graph_node_task(void *arg) {
+    thread_pool_graph_node_t *node = arg;
+    node->fn(node->arg);
+
+    // Successors are added before this task is marked as done,
+    // so the group cannot be seen as finished in between
+    for (size_t i = 0; i < node->num_successors; ++i) {
+        thread_pool_graph_node_t *successor = node->successors[i];
+        if (atomic_fetch_sub_explicit(&successor->num_remaining, 1, memory_order_acq_rel) == 1) {
+            thread_pool_group_add_task(node->graph->group, graph_node_task, successor);
+        }
+    }
+}
+
+thread_pool_graph_t * thread_pool_graph_create(thread_pool_t *pool) {
+    assert(pool != NULL);
+
+    thread_pool_graph_t *graph = malloc(sizeof(*graph));
+    if (graph == NULL) {
+        return NULL;
+    }
+
+    graph->group = thread_pool_group_create(pool);
+    if (graph->group == NULL) {
+        free(graph);
+        return NULL;
+    }
+    graph->pool = pool;
+    graph->nodes = NULL;
+    graph->num_nodes = 0;
+    graph->nodes_capacity = 0;
+    return graph;
+}
+
+thread_pool_graph_node_t * thread_pool_graph_add_node(thread_pool_graph_t *graph, thread_task_fn_t *fn, void *arg) {
+    assert(graph != NULL);
+    assert(fn != NULL);
+
+    thread_pool_graph_node_t **nodes = grow_array(graph->nodes, &graph->nodes_capacity,
+                                                  graph->num_nodes, sizeof(*nodes));
+    if (nodes == NULL) {
+        return NULL;
+    }
+    graph->nodes = nodes;
+
+    thread_pool_graph_node_t *node = malloc(sizeof(*node));
+    if (node == NULL) {
+        return NULL;
+    }
+    node->fn = fn;
+    node->arg = arg;
+    node->graph = graph;
+    node->successors = NULL;
+    node->num_successors = 0;
+    node->successors_capacity = 0;
+    node->num_predecessors = 0;
+    atomic_init(&node->num_remaining, 0);
+
+    graph->nodes[graph->num_nodes++] = node;
+    return node;
+}
+
+int thread_pool_graph_add_edge(thread_pool_graph_t *graph, thread_pool_graph_node_t *from, thread_pool_graph_node_t *to) {
+    assert(graph != NULL);
+    assert(from != NULL && from->graph == graph);
+    assert(to != NULL && to->graph == graph);
+    assert(from != to);
+    (void)graph;
+
+    thread_pool_graph_node_t **successors = grow_array(from->successors, &from->successors_capacity,
+                                                       from->num_successors, sizeof(*successors));
+    if (successors == NULL) {
+        return -1;
+    }
+    from->successors = successors;
+    from->successors[from->num_successors++] = to;
+    to->num_predecessors += 1;
+    return 0;
+}
+
+void thread_pool_graph_submit(thread_pool_graph_t *graph) {
+    assert(graph != NULL);
+
+    // All counters must be reset before the first task runs
+    for (size_t i = 0; i < graph->num_nodes; ++i) {
+        thread_pool_graph_node_t *node = graph->nodes[i];
+        atomic_store_explicit(&node->num_remaining, node->num_predecessors, memory_order_relaxed);
+    }
+
+    size_t num_roots = 0;
+    for (size_t i = 0; i < graph->num_nodes; ++i) {
+        thread_pool_graph_node_t *node = graph->nodes[i];
+        if (node->num_predecessors == 0) {
+            thread_pool_group_add_task(graph->group, graph_node_task, node);
+            num_roots += 1;
+        }
+    }
+    // assert msg: The graph has a cycle
+    assert(graph->num_nodes == 0 || num_roots != 0);
+    (void)num_roots;
+}
+
+void thread_pool_graph_wait(thread_pool_graph_t *graph) {
+    assert(graph != NULL);
+    thread_pool_group_wait(graph->group);
+}
+
+void thread_pool_graph_run(thread_pool_graph_t *graph) {
+    thread_pool_graph_submit(graph);
+    thread_pool_graph_wait(graph);
+}
+
+void thread_pool_graph_delete(thread_pool_graph_t *graph) {
+    if (graph == NULL) {
+        return;
+    }
+
+    thread_pool_group_delete(graph->group);
+    for (size_t i = 0; i < graph->num_nodes; ++i) {
+        free(graph->nodes[i]->successors);
+        free(graph->nodes[i]);
+    }
+    free(graph->nodes);
+    free(graph);
+}
@@ -0,0 +1,51 @@
+#ifndef THREAD_POOL_GRAPH_H
+#define THREAD_POOL_GRAPH_H
+
+#include "thread_pool.h"
+
+/// A directed acyclic graph of tasks run on a thread pool,
+/// a task starts as soon as all the tasks it depends on are done
+typedef struct thread_pool_graph_s thread_pool_graph_t;
+
+/// A task of a graph
+typedef struct thread_pool_graph_node_s thread_pool_graph_node_t;
+
+/// Creates an empty graph whose tasks will run on the pool
+///
+/// \return The graph or NULL in case of error
+thread_pool_graph_t * thread_pool_graph_create(thread_pool_t *pool);
+
+/// Adds a task to the graph, fn(arg) is called each time the graph runs
+///
+/// \return The node (owned by the graph) or NULL in case of error
+thread_pool_graph_node_t * thread_pool_graph_add_node(thread_pool_graph_t *graph, thread_task_fn_t *fn, void *arg);
+
+/// Makes the task of node `to` wait for the task of node `from`
+///
+/// Both nodes must belong to the graph and the edge must not create a cycle.
+///
+/// \return 0 on success, -1 in case of error
+int thread_pool_graph_add_edge(thread_pool_graph_t *graph, thread_pool_graph_node_t *from, thread_pool_graph_node_t *to);
+
+/// Starts the tasks that do not depend on any other,
+/// the others are added to the pool when their last dependency finishes
+///
+/// The graph must not be modified or submitted again until
+/// thread_pool_graph_wait returns
+void thread_pool_graph_submit(thread_pool_graph_t *graph);
+
+/// Blocks until all the tasks of the graph are done,
+/// running queued tasks of the pool meanwhile (like thread_pool_group_wait)
+///
+/// The graph can be submitted again afterwards
+void thread_pool_graph_wait(thread_pool_graph_t *graph);
+
+/// Same as thread_pool_graph_submit followed by thread_pool_graph_wait
+void thread_pool_graph_run(thread_pool_graph_t *graph);
+
+/// Waits for the graph's tasks then deletes the graph and its nodes
+///
+/// graph may be NULL
+void thread_pool_graph_delete(thread_pool_graph_t *graph);
+
+#endif // THREAD_POOL_GRAPH_H
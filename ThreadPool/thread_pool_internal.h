@@ -0,0 +1,64 @@
+#ifndef THREAD_POOL_INTERNAL_H
+#define THREAD_POOL_INTERNAL_H
+
+// Helpers shared by the pool, the graphs and the pipelines,
+// not part of the API
+
+#include <stddef.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+
+/// Size used to pad data that is written by different threads
+/// so that it does not end up sharing a cache line
+#define CACHE_LINE_SIZE 64
+
+void *aligned_malloc(size_t alignment, size_t size);
+
+void aligned_free(void *ptr);
+
+/// Grows the array so that it can hold at least one more item than size
+///
+/// \return The (possibly moved) array or NULL in case of error,
+///  in which case the array is left untouched
+void *grow_array(void *items, size_t *capacity, size_t size, size_t item_size);
+
+/// Bounded multi-producer multi-consumer lock-free queue,
+/// items of item_size bytes being stored by value
+///
+/// Each cell carries a sequence number, producers and consumers
+/// claim a position with a CAS and then wait for the cell's sequence
+/// to match that position.
+///
+/// "Bounded MPMC queue", Dmitry Vyukov
+typedef struct mpmc_ring_s {
+    /// NULL when the ring was not initialized
+    unsigned char *cells;
+    /// Size of a cell, its sequence followed by the item
+    size_t cell_size;
+    size_t item_size;
+    /// Capacity - 1, the capacity being a power of two
+    size_t mask;
+    _Alignas(CACHE_LINE_SIZE) _Atomic size_t enqueue_pos;
+    _Alignas(CACHE_LINE_SIZE) _Atomic size_t dequeue_pos;
+} mpmc_ring_t;
+
+/// Makes a ring with room for at least capacity items
+///
+/// \return 0 on success
+int mpmc_ring_init(mpmc_ring_t *ring, size_t capacity, size_t item_size);
+
+void mpmc_ring_destroy(mpmc_ring_t *ring);
+
+/// Returns false if the ring is full
+bool mpmc_ring_try_push(mpmc_ring_t *ring, const void *item);
+
+/// Returns false if the ring is empty
+bool mpmc_ring_try_pop(mpmc_ring_t *ring, void *item);
+
+/// May return false while a producer is still writing its item
+bool mpmc_ring_is_empty(mpmc_ring_t *ring);
+
+/// Number of items in the ring, only a hint
+size_t mpmc_ring_size(mpmc_ring_t *ring);
+
+#endif // THREAD_POOL_INTERNAL_H
@@ -0,0 +1,330 @@
+#include <stddef.h>
+#include <stdlib.h>
+#include <assert.h>
+#include <stdatomic.h>
+
+#include "thread_pool_pipeline.h"
+#include "thread_pool_internal.h"
+
+/// An item in the pipeline, a pipeline has max_items of them
+typedef struct pipeline_token_s {
+    thread_pool_pipeline_t *pipeline;
+    void *item;
+    /// Position of the item in the order the first stage produced them
+    size_t sequence;
+    /// Next stage the item goes through
+    size_t stage;
+} pipeline_token_t;
+
+typedef struct pipeline_stage_s {
+    thread_pool_stage_mode_t mode;
+    thread_pool_stage_fn_t *fn;
+    void *ctx;
+    /// Pointers to the tokens waiting for a serial stage
+    mpmc_ring_t channel;
+    /// Tokens waiting for an in order stage, token of sequence s being
+    /// in slot s % max_items (there are never more than max_items in flight)
+    _Atomic(pipeline_token_t *) *reorder;
+    /// Sequence the in order stage expects next
+    _Atomic size_t next_sequence;
+    /// Whether a thread is running the serial stage
+    _Atomic bool busy;
+} pipeline_stage_t;
+
+struct thread_pool_pipeline_s {
+    thread_pool_t *pool;
+    /// Tasks of the current run not yet finished
+    thread_pool_group_t *group;
+    pipeline_stage_t *stages;
+    size_t num_stages;
+    size_t stages_capacity;
+
+    pipeline_token_t *tokens;
+    size_t max_items;
+    /// Tokens not in use
+    mpmc_ring_t free_tokens;
+    /// Sequence of the next item of the first stage, only used by the thread running it
+    size_t next_sequence;
+    /// The first stage returned NULL
+    _Atomic bool input_done;
+};
+
+/// Channels have room for all the tokens of the pipeline, so pushing never fails
+static void channel_push(mpmc_ring_t *channel, pipeline_token_t *token) {
+    bool pushed = mpmc_ring_try_push(channel, &token);
+    assert(pushed);
+    (void)pushed;
+}
+
+/// \return The oldest token or NULL if the channel is empty
+static pipeline_token_t *channel_pop(mpmc_ring_t *channel) {
+    pipeline_token_t *token;
+    return mpmc_ring_try_pop(channel, &token) ? token : NULL;
+}
+
+/// Hands the token to a serial stage
+static void stage_push(thread_pool_pipeline_t *pipeline, pipeline_stage_t *stage, pipeline_token_t *token) {
+    if (stage->mode == THREAD_POOL_STAGE_SERIAL_IN_ORDER) {
+        atomic_store_explicit(&stage->reorder[token->sequence % pipeline->max_items], token, memory_order_seq_cst);
+    } else {
+        channel_push(&stage->channel, token);
+    }
+}
+
+/// Takes the next token a serial stage can run, only called by the thread running the stage
+///
+/// \return The token or NULL if there is none
+static pipeline_token_t *stage_pop(thread_pool_pipeline_t *pipeline, pipeline_stage_t *stage) {
+    if (stage->mode != THREAD_POOL_STAGE_SERIAL_IN_ORDER) {
+        return channel_pop(&stage->channel);
+    }
+
+    size_t sequence = atomic_load_explicit(&stage->next_sequence, memory_order_relaxed);
+    _Atomic(pipeline_token_t *) *slot = &stage->reorder[sequence % pipeline->max_items];
+    pipeline_token_t *token = atomic_load_explicit(slot, memory_order_acquire);
+    if (token != NULL) {
+        atomic_store_explicit(slot, NULL, memory_order_relaxed);
+        atomic_store_explicit(&stage->next_sequence, sequence + 1, memory_order_relaxed);
+    }
+    return token;
+}
+
+/// Whether stage_pop would return a token
+static bool stage_is_ready(thread_pool_pipeline_t *pipeline, pipeline_stage_t *stage) {
+    if (stage->mode != THREAD_POOL_STAGE_SERIAL_IN_ORDER) {
+        return !mpmc_ring_is_empty(&stage->channel);
+    }
+    size_t sequence = atomic_load_explicit(&stage->next_sequence, memory_order_seq_cst);
+    return atomic_load_explicit(&stage->reorder[sequence % pipeline->max_items], memory_order_seq_cst) != NULL;
+}
+
+static void pipeline_advance(thread_pool_pipeline_t *pipeline, pipeline_token_t *token);
+
+static void pipeline_token_task(void *arg) {
+    pipeline_token_t *token = arg;
+    pipeline_advance(token->pipeline, token);
+}
+
+static void pipeline_spawn(thread_pool_pipeline_t *pipeline, pipeline_token_t *token) {
+    thread_pool_group_add_task(pipeline->group, pipeline_token_task, token);
+}
+
+/// Runs the first stage while there are free tokens, each item
+/// going through the next stages in a task of its own
+static void pipeline_pump(thread_pool_pipeline_t *pipeline) {
+    pipeline_stage_t *source = &pipeline->stages[0];
+
+    // Orders the release of the caller's token before the check of busy,
+    // pairs with the fence after releasing the first stage
+    atomic_thread_fence(memory_order_seq_cst);
+    while (!atomic_load_explicit(&pipeline->input_done, memory_order_relaxed)) {
+        if (atomic_exchange(&source->busy, true)) {
+            return;
+        }
+        while (!atomic_load_explicit(&pipeline->input_done, memory_order_relaxed)) {
+            // NULL also when a token is being released, the thread
+            // releasing it calls this function afterwards
+            pipeline_token_t *token = channel_pop(&pipeline->free_tokens);
+            if (token == NULL) {
+                break;
+            }
+            void *item = source->fn(source->ctx, NULL);
+            if (item == NULL) {
+                atomic_store_explicit(&pipeline->input_done, true, memory_order_relaxed);
+                channel_push(&pipeline->free_tokens, token);
+                break;
+            }
+
+            token->item = item;
+            token->sequence = pipeline->next_sequence++;
+            token->stage = 1;
+            pipeline_spawn(pipeline, token);
+        }
+        atomic_store(&source->busy, false);
+        atomic_thread_fence(memory_order_seq_cst);
+
+        // A token released after the last pop saw the stage busy, and left it to us
+        if (mpmc_ring_is_empty(&pipeline->free_tokens)) {
+            break;
+        }
+    }
+}
+
+/// The item is out of the pipeline, its token can carry another one
+static void pipeline_release_token(thread_pool_pipeline_t *pipeline, pipeline_token_t *token) {
+    channel_push(&pipeline->free_tokens, token);
+    pipeline_pump(pipeline);
+}
+
+/// Runs the tokens queued in a serial stage until there are none,
+/// unless another thread already runs the stage
+///
+/// The last token the stage ran then continues through the next stages
+/// on this thread, the others in tasks of their own
+static void pipeline_serve(thread_pool_pipeline_t *pipeline, size_t stage_index) {
+    pipeline_stage_t *stage = &pipeline->stages[stage_index];
+    pipeline_token_t *token = NULL;
+
+    // Orders the push of the caller's token before the check of busy,
+    // pairs with the fence after releasing the stage
+    atomic_thread_fence(memory_order_seq_cst);
+    while (1) {
+        if (atomic_exchange(&stage->busy, true)) {
+            break;
+        }
+        pipeline_token_t *next;
+        while ((next = stage_pop(pipeline, stage)) != NULL) {
+            if (token != NULL) {
+                pipeline_spawn(pipeline, token);
+            }
+            if (next->item != NULL) {
+                next->item = stage->fn(stage->ctx, next->item);
+            }
+            next->stage = stage_index + 1;
+            token = next;
+        }
+        atomic_store(&stage->busy, false);
+        atomic_thread_fence(memory_order_seq_cst);
+
+        // A token pushed after the last pop saw the stage busy, and left it to us
+        if (!stage_is_ready(pipeline, stage)) {
+            break;
+        }
+    }
+
+    if (token != NULL) {
+        pipeline_advance(pipeline, token);
+    }
+}
+
+/// Runs the token through the parallel stages from token->stage on,
+/// until it is out of the pipeline or hands it to a serial stage
+static void pipeline_advance(thread_pool_pipeline_t *pipeline, pipeline_token_t *token) {
+    for (size_t i = token->stage; i < pipeline->num_stages; ++i) {
+        pipeline_stage_t *stage = &pipeline->stages[i];
+        if (stage->mode != THREAD_POOL_STAGE_PARALLEL) {
+            // Dropped items still go through serial stages, so
+            // in order stages do not wait for them
+            stage_push(pipeline, stage, token);
+            pipeline_serve(pipeline, i);
+            return;
+        }
+        if (token->item != NULL) {
+            token->item = stage->fn(stage->ctx, token->item);
+        }
+    }
+    pipeline_release_token(pipeline, token);
+}
+
+thread_pool_pipeline_t * thread_pool_pipeline_create(thread_pool_t *pool, size_t max_items) {
+    assert(pool != NULL);
+    if (max_items == 0) {
+        max_items = 1;
+    }
+
+    thread_pool_pipeline_t *pipeline = malloc(sizeof(*pipeline));
+    if (pipeline == NULL) {
+        return NULL;
+    }
+    pipeline->pool = pool;
+    pipeline->stages = NULL;
+    pipeline->num_stages = 0;
+    pipeline->stages_capacity = 0;
+    pipeline->max_items = max_items;
+    pipeline->free_tokens.cells = NULL;
+    pipeline->tokens = malloc(sizeof(pipeline_token_t) * max_items);
+    pipeline->group = thread_pool_group_create(pool);
+    if (pipeline->tokens == NULL || pipeline->group == NULL
+        || mpmc_ring_init(&pipeline->free_tokens, max_items, sizeof(pipeline_token_t *)) != 0) {
+        thread_pool_pipeline_delete(pipeline);
+        return NULL;
+    }
+    return pipeline;
+}
+
+int thread_pool_pipeline_add_stage(thread_pool_pipeline_t *pipeline, thread_pool_stage_mode_t mode,
+                                   thread_pool_stage_fn_t *fn, void *ctx) {
+    assert(pipeline != NULL);
+    assert(fn != NULL);
+
+    pipeline_stage_t *stages = grow_array(pipeline->stages, &pipeline->stages_capacity,
+                                          pipeline->num_stages, sizeof(*stages));
+    if (stages == NULL) {
+        return -1;
+    }
+    pipeline->stages = stages;
+
+    if (pipeline->num_stages == 0) {
+        mode = THREAD_POOL_STAGE_SERIAL;
+    }
+    pipeline_stage_t *stage = &pipeline->stages[pipeline->num_stages];
+    stage->mode = mode;
+    stage->fn = fn;
+    stage->ctx = ctx;
+    stage->channel.cells = NULL;
+    stage->reorder = NULL;
+    // The first stage produces the tokens, none are ever pushed to it
+    if (mode == THREAD_POOL_STAGE_SERIAL && pipeline->num_stages != 0
+        && mpmc_ring_init(&stage->channel, pipeline->max_items, sizeof(pipeline_token_t *)) != 0) {
+        return -1;
+    }
+    if (mode == THREAD_POOL_STAGE_SERIAL_IN_ORDER) {
+        stage->reorder = malloc(sizeof(*stage->reorder) * pipeline->max_items);
+        if (stage->reorder == NULL) {
+            return -1;
+        }
+        for (size_t i = 0; i < pipeline->max_items; ++i) {
+            atomic_init(&stage->reorder[i], NULL);
+        }
+    }
+    atomic_init(&stage->next_sequence, 0);
+    atomic_init(&stage->busy, false);
+
+    pipeline->num_stages += 1;
+    return 0;
+}
+
+void thread_pool_pipeline_run(thread_pool_pipeline_t *pipeline) {
+    assert(pipeline != NULL);
+    if (pipeline->num_stages == 0) {
+        return;
+    }
+
+    // Everything is back to its initial state after a run, but the sequences
+    for (size_t i = 0; i < pipeline->num_stages; ++i) {
+        atomic_store_explicit(&pipeline->stages[i].next_sequence, 0, memory_order_relaxed);
+    }
+    for (size_t i = 0; i < pipeline->max_items; ++i) {
+        pipeline_token_t *token = &pipeline->tokens[i];
+        token->pipeline = pipeline;
+        channel_push(&pipeline->free_tokens, token);
+    }
+    pipeline->next_sequence = 0;
+    atomic_store(&pipeline->input_done, false);
+
+    pipeline_pump(pipeline);
+    thread_pool_group_wait(pipeline->group);
+
+    // The tokens are all free once the group is done
+    for (size_t i = 0; i < pipeline->max_items; ++i) {
+        pipeline_token_t *token = channel_pop(&pipeline->free_tokens);
+        assert(token != NULL);
+        (void)token;
+    }
+}
+
+void thread_pool_pipeline_delete(thread_pool_pipeline_t *pipeline) {
+    if (pipeline == NULL) {
+        return;
+    }
+
+    thread_pool_group_delete(pipeline->group);
+    for (size_t i = 0; i < pipeline->num_stages; ++i) {
+        mpmc_ring_destroy(&pipeline->stages[i].channel);
+        free(pipeline->stages[i].reorder);
+    }
+    free(pipeline->stages);
+    mpmc_ring_destroy(&pipeline->free_tokens);
+    free(pipeline->tokens);
+    free(pipeline);
+}
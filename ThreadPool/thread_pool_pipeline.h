@@ -0,0 +1,60 @@
+#ifndef THREAD_POOL_PIPELINE_H
+#define THREAD_POOL_PIPELINE_H
+
+#include "thread_pool.h"
+
+/// A chain of stages items flow through, run by the workers of a pool
+///
+/// The first stage produces the items, each following stage gets the item
+/// returned by the previous one. At most max_items items are in the
+/// pipeline at once, the first stage is not called again until one
+/// of them is out of the last stage.
+typedef struct thread_pool_pipeline_s thread_pool_pipeline_t;
+
+/// How the calls of a stage may overlap
+typedef enum thread_pool_stage_mode_e {
+    /// Items go through the stage concurrently
+    THREAD_POOL_STAGE_PARALLEL,
+    /// Items go through the stage one at a time, in any order
+    THREAD_POOL_STAGE_SERIAL,
+    /// Items go through the stage one at a time, in the order
+    /// the first stage produced them
+    THREAD_POOL_STAGE_SERIAL_IN_ORDER,
+} thread_pool_stage_mode_t;
+
+/// The signature of a stage
+///
+/// The first stage is called with item NULL and returns the next item,
+/// or NULL when there are no more items. The other stages return the item
+/// given to the next stage, NULL dropping the item (the following stages
+/// are not called for it). What the last stage returns is ignored.
+typedef void *(thread_pool_stage_fn_t)(void *ctx, void *item);
+
+/// Creates a pipeline without stages whose items will go through the pool
+///
+/// \param max_items is the maximum number of items in the pipeline, 0 is the same as 1
+/// \return The pipeline or NULL in case of error
+thread_pool_pipeline_t * thread_pool_pipeline_create(thread_pool_t *pool, size_t max_items);
+
+/// Appends a stage to the pipeline, fn(ctx, item) being called for each item
+///
+/// The mode of the first stage is ignored, it is always serial.
+///
+/// \return 0 on success, -1 in case of error
+int thread_pool_pipeline_add_stage(thread_pool_pipeline_t *pipeline, thread_pool_stage_mode_t mode,
+                                   thread_pool_stage_fn_t *fn, void *ctx);
+
+/// Runs the pipeline until the first stage has no more items and all
+/// the items went through the stages
+///
+/// The calling thread runs queued tasks of the pool meanwhile
+/// (like thread_pool_group_wait), no thread is dedicated to a stage.
+/// The pipeline can be run again afterwards
+void thread_pool_pipeline_run(thread_pool_pipeline_t *pipeline);
+
+/// Deletes the pipeline, it must not be running
+///
+/// pipeline may be NULL
+void thread_pool_pipeline_delete(thread_pool_pipeline_t *pipeline);
+
+#endif // THREAD_POOL_PIPELINE_H